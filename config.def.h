@@ -28,10 +28,15 @@ static const char worddelimiters[] = " ";
 /* Size of the window border */
 static const unsigned int border_width = 1;
 
+/* Width of the grid scrollbar, 0 to hide it */
+static const unsigned int scrollbar_width = 4;
+
 /* -n option; preselected item starting from 0 */
 static int preselected = 0;
 
 /* icon options */
 static unsigned int icon_size = 0;
+static unsigned int icon_cache = 64; /* -icache option; MB of icons kept */
 static char *icon_command = NULL;
+static char *icon_theme = NULL; /* -itheme option; freedesktop icon theme */
 static char *icon_fallback = "/usr/share/icons/Adwaita/512x512/mimetypes/application-x-generic.png";
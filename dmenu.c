@@ -1,12 +1,29 @@
 /* See LICENSE file for copyright and license details. */
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <time.h>
 #include <unistd.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
@@ -29,6 +46,26 @@
 #define TEXTW(X)              (drw_fontset_getwidth(drw, (X)) + lrpad)
 #define NUMBERSMAXDIGITS      100
 #define NUMBERSBUFSIZE        (NUMBERSMAXDIGITS * 2) + 1
+#define SCROLLMS              16 /* frame interval of smooth scrolling */
+#define GRABMS                1000 /* give up grabbing keyboard or focus after */
+#define GENDELAYMS            120 /* -gen waits this long for more keystrokes */
+#define GENCACHE              16 /* -gen results kept for recent queries */
+#define KILLMS                1000 /* stopped children get SIGKILL after this */
+#define SOURCES               16 /* -src commands at most */
+#define WATCHMS               1000 /* -watch checks this often without inotify */
+#define WATCHCUT              UINT32_MAX /* a watched line that edited others */
+#define MCACHE                64 /* match lists kept for recent inputs */
+#define MCACHEBYTES           (64 << 20) /* and the most memory they may use */
+#define TILES                 512 /* rendered grid cells kept for reuse */
+#define TILEBYTES             (32 << 20) /* and the most memory they may use */
+#define ICONBYTES             ((size_t)icon_size * icon_size * 4) /* per icon */
+#define TRIBITS               6 /* bits per folded byte class in a trigram */
+#define NTRI                  (1 << (3 * TRIBITS))
+#define REMOVED               (-2) /* tier of a deleted item */
+#define SNAPALIGN(n)          (((n) + 7) & ~(uint64_t)7)
+#define SORTTHREADS           8 /* -sort uses this many threads at most */
+#define SORTSPLIT             (1 << 14) /* buckets split among the threads */
+#define FIELDS                16 /* ranges of -nth or -with-nth at most */
 
 /* enums */
 enum {
@@ -42,13 +79,106 @@ enum {
 	LocBottomRight, LocBottomLeft
 }; /* locations */
 
+enum { InLines, InNul, InRecord }; /* input formats */
+enum { SortNone, SortAlpha, SortLength, SortNatural }; /* -sort orders */
+
+/* the rarely used part of an item; what matching reads is kept apart in
+ * keys, keyoff, keylen, keysig and tiers, indexed like items */
 struct item {
-	char *text;
+	char *text; /* only with -i, the key is the text otherwise */
+	uint32_t ext; /* position in exts + 1, 0 if it has no value, id or icon */
+	uint32_t iconslot; /* position in iconv + 1, 0 if no icon is kept */
+	unsigned char out;
+	unsigned char src; /* the -src it came from, counting from 1; 0 for stdin */
+	unsigned char iconloaded; /* loading its icon was tried */
+};
+
+/* the fields few items have */
+struct itemext {
 	char *value;
 	char *id;
-	Icn icon;
-	struct item *left, *right;
-	int out;
+	char *icon; /* --icon= */
+};
+
+/* a scaled icon kept in memory */
+struct icon {
+	Imlib_Image img;
+	uint32_t item; /* position in items */
+	uint32_t used; /* for least recently used eviction */
+};
+
+/* trigram inverted index; posting lists are delta coded varints */
+struct trindex {
+	uint32_t *cnt;       /* number of items containing each trigram */
+	uint64_t *off;       /* NTRI + 1 offsets of the posting lists in post */
+	unsigned char *post;
+	uint64_t n;          /* number of items covered */
+	void *map;           /* sidecar file mapping, if loaded from one */
+	size_t maplen;
+};
+
+/* sidecar header, followed by cnt, off and post as laid out in memory */
+struct trihdr {
+	char magic[8];
+	uint64_t n, hash, postlen;
+};
+
+/* a rendered grid cell */
+struct tile {
+	char *key; /* see tilekey() */
+	Imlib_Image icon;
+	int w;
+	Pixmap pm;
+	unsigned long used; /* for least recently used eviction */
+};
+
+/* the file chosen so far for an icon name of the -itheme theme */
+struct themeicon {
+	char *name, *path;
+	unsigned long rank; /* lower is better, see themescan() */
+};
+
+/* the match list of an earlier input */
+struct mcache {
+	char *text;
+	uint32_t *v;
+	size_t n, tierend[3];
+};
+
+/* -save-snapshot header, followed by keysig, keyoff, keylen, width and
+ * the 4 field offsets (text with -i, value, id, icon; + 1, 0 if unset) of
+ * every item, then the keys and the field strings, each padded to 8
+ * bytes, then if tri is set cnt, off and post as in the trigram sidecar */
+struct snaphdr {
+	char magic[8];
+	uint64_t n, keyslen, strslen, postlen;
+	uint64_t font; /* fonthash() the widths were measured with */
+	uint64_t fields; /* fieldhash() the keys and texts were split with */
+	uint32_t fold, tri;
+};
+
+/* output of a -gen run for one query */
+struct genres {
+	char *query;
+	char *out;
+	size_t len;
+};
+
+/* a -src command, its output read as it comes like -S */
+struct source {
+	const char *cmd;
+	pid_t pid;
+	int fd;
+	char *buf;
+	size_t len, size;
+};
+
+/* open-addressing hash index; slots hold a position + 1 in the array
+ * that key reads, items unless said otherwise */
+struct htab {
+	uint32_t *slot;
+	size_t size, count;
+	const char *(*key)(size_t);
 };
 
 static char numbers[NUMBERSBUFSIZE] = "";
@@ -63,8 +193,89 @@ static int inputw = 0, promptw, passwd = 0;
 static int lrpad; /* sum of left and right padding */
 static size_t cursor;
 static struct item *items = NULL;
-static struct item *matches, *matchend;
-static struct item *prev, *curr, *next, *sel;
+static size_t nitems, itemsize;
+static struct itemext *exts; /* indexed by item->ext - 1 */
+static uint32_t *extfree; /* positions in exts free for reuse */
+static size_t nexts, nextfree, extsize;
+static const struct itemext noext; /* what items without one read */
+static uint32_t *matchv; /* item indices of the matches, in display order */
+static size_t nmatches, matchvsize, nremoved;
+static size_t tierend[3]; /* end of the exact/prefix/substring tiers in matchv */
+static struct mcache mcache[MCACHE]; /* most recent first */
+static int matcher; /* match() hands the input to the worker */
+static pthread_t matchthread;
+static pthread_mutex_t matchlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t matchcond = PTHREAD_COND_INITIALIZER;
+static unsigned long mgen; /* bumped for every input */
+static char mtext[sizeof text]; /* the input of generation mgen */
+static uint32_t *mv; /* the worker's matches, swapped with matchv */
+static size_t mtierend[3];
+static int mready, mquit, mpending;
+static int mpipe[2] = { -1, -1 }; /* the worker wakes run() through this */
+static size_t mcachebytes;
+static char **tokv = NULL;
+static int tokn = 0, tokc = 0;
+static size_t toklen, textsize;
+static uint64_t toksig; /* bytes every matching key contains */
+static size_t tokmax; /* length of the longest token */
+static int regexmode = 0; /* -r option; the input is an extended regex */
+static regex_t re;
+static int reok; /* re holds the compiled input text */
+static struct trindex tri;
+static const char *snapfile = NULL; /* -snapshot option; items are loaded from */
+static const char *snapout = NULL; /* -save-snapshot option */
+static char *snap; /* the mapped -snapshot */
+static size_t snaplen;
+static const uint32_t *itemws; /* text widths from the snapshot, or NULL */
+static uint32_t *tricand;
+static size_t ntricand;
+static int trigrams = 0; /* -tri option; index items by trigram */
+static const char *trifile = NULL; /* -trif option; trigram index sidecar */
+static int streamfd = -1; /* -S option; keep reading stdin while running */
+static char *streambuf;
+static size_t streamlen, streamsize;
+static int informat = InLines; /* -0 and -R options */
+static int sortmode = SortNone; /* -sort option */
+static struct source srcs[SOURCES];
+static int nsrcs, nsrcopen;
+static int srcorder = 1; /* -srcorder option; rank items by source first */
+static unsigned char cursrc; /* source of the lines being streamed */
+static const char *watchpath = NULL; /* -watch option; file items are read from */
+static int watchfd = -1; /* inotify, or -1 to check every WATCHMS */
+static char *watchbuf; /* the file as last read */
+static size_t watchlen;
+static uint32_t *watchline; /* item made by each line, see watchload() */
+static size_t nwatchlines, watchlinesize;
+static const char *gencmd = NULL; /* -gen option; command run per query */
+static pid_t genpid = 0;
+/* children left to exit on their own, reaped from run() */
+static struct child {
+	pid_t pid;
+	struct timespec at; /* when it was sent SIGTERM */
+	int term;
+} *children;
+static size_t nchildren, childrensize;
+static int genpending, genhave; /* a run is due; genquery was run */
+static struct timespec genat; /* when the query last changed */
+static char genquery[sizeof text];
+static char *genout; /* output of the running generator so far */
+static size_t genoutlen, genoutsize;
+static struct genres gencache[GENCACHE]; /* most recent first */
+static char *arena; /* raw -0/-R input; items of those formats point into it */
+static size_t arenalen;
+static size_t prev, curr, next, sel; /* positions in matchv */
+static int scrolly, scrollto; /* grid scroll offset in pixels and its target */
+static int drawny = -1; /* scrolly of the grid in the pixmap, -1 if stale */
+static struct tile tiles[TILES];
+static size_t ntiles, tilebytes;
+static unsigned long tileclock;
+static struct icon *iconv;
+static size_t niconv, iconvsize, iconbytes;
+static uint32_t iconclock;
+static int scrolldir = 1; /* last direction the grid scrolled in */
+static int prefetching; /* icons past the view may still need loading */
+static struct themeicon *themeicons; /* open addressed by name */
+static size_t nthemeicons, themeiconsize;
 static int mon = -1, screen;
 static int managed = 1;
 static int bidi = 0;
@@ -79,8 +290,17 @@ static Clr *scheme[SchemeLast];
 
 #include "config.h"
 
-static int (*fstrncmp)(const char *, const char *, size_t) = strncmp;
-static char *(*fstrstr)(const char *, const char *) = strstr;
+static int fold = 0; /* -i option; match folded keys */
+static const char *delim = NULL; /* -d option; fields are split on blanks without */
+static int nth[FIELDS][2], nnth; /* -nth option; ranges of fields matched */
+static int wnth[FIELDS][2], nwnth; /* -with-nth option; ranges of fields shown */
+static char *keys; /* search text of the items, NUL-separated; folded with -i,
+                    * only the -nth fields with it */
+static size_t keyslen, keyssize, keysgarbage;
+static uint32_t *keyoff, *keylen;
+static uint64_t *keysig; /* byte classes present in each key, see sign() */
+static signed char *tiers; /* match tier of each item, -1 if not matched */
+static char query[2 * sizeof text]; /* the input text as matched */
 
 static unsigned int
 textw_clamp(const char *str, unsigned int n)
@@ -89,17 +309,61 @@ textw_clamp(const char *str, unsigned int n)
 	return MIN(w, n);
 }
 
-static void
-appenditem(struct item *item, struct item **list, struct item **last)
+static char *itemtext(const struct item *item);
+
+/* textw_clamp() of the text of item, from the snapshot if it has it */
+static unsigned int
+itemw(const struct item *item, unsigned int n)
 {
-	if (*last)
-		(*last)->right = item;
-	else
-		*list = item;
+	if (itemws)
+		return MIN(itemws[item - items] + lrpad, n);
+	return textw_clamp(itemtext(item), n);
+}
+
+static const char *
+searchkey(const struct item *item)
+{
+	return keys + keyoff[item - items];
+}
+
+/* whether the keys are not the texts, which are then kept in item->text */
+static int
+keyapart(void)
+{
+	return fold || nnth;
+}
+
+static char *
+itemtext(const struct item *item)
+{
+	return keyapart() ? item->text : keys + keyoff[item - items];
+}
+
+/* whether items may still come, change or go */
+static int
+streaming(void)
+{
+	return streamfd >= 0 || nsrcopen || watchpath;
+}
+
+static struct item *
+matchat(size_t i)
+{
+	return &items[matchv[i]];
+}
+
+static struct item *
+selected(void)
+{
+	return nmatches ? matchat(sel) : NULL;
+}
 
-	item->left = *last;
-	item->right = NULL;
-	*last = item;
+static int
+maxscroll(void)
+{
+	int rows = (nmatches + columns - 1) / columns;
+
+	return MAX(0, (rows - (int)lines) * bh);
 }
 
 static void
@@ -107,65 +371,551 @@ calcoffsets(void)
 {
 	int i, n;
 
-	if (lines > 0)
-		n = lines * columns * bh;
-	else
-		n = mw - (promptw + inputw + TEXTW("<") + TEXTW(">"));
+	if (lines > 0) {
+		/* the grid scrolls by pixels; curr is the first row in view */
+		n = lines * columns;
+		scrolly = MIN(scrolly, maxscroll());
+		scrollto = MIN(scrollto, maxscroll());
+		curr = scrolly / bh * columns;
+		next = MIN(curr + n, nmatches);
+		prev = curr > n ? curr - n : 0;
+		return;
+	}
+	n = mw - (promptw + inputw + TEXTW("<") + TEXTW(">"));
 	/* calculate which items will begin the next page and previous page */
-	for (i = 0, next = curr; next; next = next->right)
-		if ((i += (lines > 0) ? bh : textw_clamp(next->text, n)) > n)
+	for (i = 0, next = curr; next < nmatches; next++)
+		if ((i += itemw(matchat(next), n)) > n)
 			break;
-	for (i = 0, prev = curr; prev && prev->left; prev = prev->left)
-		if ((i += (lines > 0) ? bh : textw_clamp(prev->left->text, n)) > n)
+	for (i = 0, prev = curr; prev > 0; prev--)
+		if ((i += itemw(matchat(prev - 1), n)) > n)
 			break;
 }
 
+/* make item i start the page; in the grid its row is scrolled to the top */
+static void
+setcurr(size_t i)
+{
+	if (lines > 0)
+		scrolly = scrollto = MIN((int)(i / columns) * bh, maxscroll());
+	else
+		curr = i;
+	calcoffsets();
+}
+
+/* end of the items that are at least partly in view */
+static size_t
+visibleend(void)
+{
+	if (lines == 0)
+		return next;
+	return MIN(((scrolly + lines * bh - 1) / bh + 1) * columns, nmatches);
+}
 static int
 max_textw(void)
 {
 	int len = 0;
-	for (struct item *item = items; item && item->text; item++)
-		len = MAX(TEXTW(item->text), len);
+	for (size_t i = 0; i < nitems; i++)
+		if (tiers[i] != REMOVED)
+			len = MAX(itemw(&items[i], UINT_MAX), len);
 	return len;
 }
 
+/* whether s was allocated, and is not a part of the input or snapshot */
+static int
+owned(const char *s)
+{
+	return (s < arena || s > arena + arenalen) &&
+	       (s < snap || s >= snap + snaplen);
+}
+
+static void
+freefield(char *s)
+{
+	if (owned(s))
+		free(s);
+}
+
+static unsigned long
+hashstr(const char *s)
+{
+	unsigned long h = 2166136261UL;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619UL;
+	return h;
+}
+
+/* return the slot holding key, or the empty slot where it would go */
+static uint32_t *
+hfind(struct htab *t, const char *key)
+{
+	size_t i;
+
+	for (i = hashstr(key) & (t->size - 1); t->slot[i]; i = (i + 1) & (t->size - 1))
+		if (!strcmp(t->key(t->slot[i] - 1), key))
+			break;
+	return &t->slot[i];
+}
+
+static struct item *
+hget(struct htab *t, const char *key)
+{
+	uint32_t *p;
+
+	if (!t->size || !key)
+		return NULL;
+	p = hfind(t, key);
+	return *p ? &items[*p - 1] : NULL;
+}
+
+static void
+hput(struct htab *t, size_t pos)
+{
+	uint32_t *old = t->slot;
+	size_t i, oldsize = t->size;
+
+	if (2 * (t->count + 1) > t->size) {
+		t->size = t->size ? t->size * 2 : 64;
+		t->slot = ecalloc(t->size, sizeof *t->slot);
+		for (i = 0; i < oldsize; i++)
+			if (old[i])
+				*hfind(t, t->key(old[i] - 1)) = old[i];
+		free(old);
+	}
+	*hfind(t, t->key(pos)) = pos + 1;
+	t->count++;
+}
+
+static void
+hdel(struct htab *t, size_t pos)
+{
+	size_t i, j, k;
+
+	if (!t->size)
+		return;
+	i = hfind(t, t->key(pos)) - t->slot;
+	if (!t->slot[i])
+		return;
+	/* backward shift deletion keeps every probe sequence unbroken */
+	for (j = i; t->slot[j = (j + 1) & (t->size - 1)];) {
+		k = hashstr(t->key(t->slot[j] - 1)) & (t->size - 1);
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			t->slot[i] = t->slot[j];
+			i = j;
+		}
+	}
+	t->slot[i] = 0;
+	t->count--;
+}
+
+static const char *
+tileat(size_t i)
+{
+	return tiles[i].key;
+}
+
+static struct htab tileh = { .key = tileat };
+
+/* the key of a tile of text in scheme sch, w wide, showing icon img */
+static const char *
+tilekey(const char *s, int sch, int w, Imlib_Image img)
+{
+	static char *buf;
+	static size_t size;
+	size_t n = strlen(s) + 64;
+
+	if (n > size && !(buf = realloc(buf, size = n)))
+		die("cannot realloc %zu bytes:", size);
+	snprintf(buf, size, "%d %d %p %s", sch, w, img, s);
+	return buf;
+}
+
+static void
+tilefree(struct tile *t)
+{
+	size_t i = t - tiles;
+
+	hdel(&tileh, i);
+	XFreePixmap(dpy, t->pm);
+	free(t->key);
+	tilebytes -= (size_t)t->w * bh * 4;
+	*t = tiles[--ntiles];
+	/* the slot of the moved tile is found by its key, still in place */
+	if (i < ntiles)
+		*hfind(&tileh, t->key) = i + 1;
+}
+
+static Imlib_Image
+itemicon(const struct item *item)
+{
+	return item->iconslot ? iconv[item->iconslot - 1].img : NULL;
+}
+
+/* free the icon of item so it is loaded again when needed; tiles showing
+ * it go too, a later image may get the same address */
+static void
+icondrop(struct item *item)
+{
+	struct tile *t;
+	struct icon *ic;
+
+	if (!item->iconslot)
+		return;
+	ic = &iconv[item->iconslot - 1];
+	for (t = tiles; t < tiles + ntiles;)
+		if (t->icon == ic->img)
+			tilefree(t);
+		else
+			t++;
+	imlib_context_set_image(ic->img);
+	imlib_free_image();
+	*ic = iconv[--niconv];
+	items[ic->item].iconslot = item->iconslot;
+	item->iconslot = 0;
+	item->iconloaded = 0;
+	iconbytes -= ICONBYTES;
+}
+
+static const struct itemext *
+itemext(const struct item *item)
+{
+	return item->ext ? &exts[item->ext - 1] : &noext;
+}
+
+/* the fields of item to set, taking a free entry of exts if it has none */
+static struct itemext *
+extnew(struct item *item)
+{
+	if (item->ext)
+		return &exts[item->ext - 1];
+	if (nextfree) {
+		item->ext = extfree[--nextfree];
+	} else {
+		if (nexts == extsize) {
+			extsize = extsize ? extsize * 2 : 64;
+			if (extsize > UINT32_MAX)
+				die("too many items");
+			if (!(exts = realloc(exts, extsize * sizeof *exts)) ||
+			    !(extfree = realloc(extfree, extsize * sizeof *extfree)))
+				die("cannot realloc %zu items:", extsize);
+		}
+		item->ext = ++nexts;
+	}
+	memset(&exts[item->ext - 1], 0, sizeof *exts);
+	return &exts[item->ext - 1];
+}
+
+static void
+freeitem(struct item *item)
+{
+	struct itemext *e;
+
+	freefield(item->text);
+	if (item->ext) {
+		e = &exts[item->ext - 1];
+		freefield(e->value);
+		freefield(e->id);
+		freefield(e->icon);
+		extfree[nextfree++] = item->ext;
+		item->ext = 0;
+	}
+	icondrop(item);
+}
+
+/* milliseconds since t on the monotonic clock */
+static long
+sincems(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/* leave the child pid to exit, sending its process group SIGTERM if term
+ * is set, so the UI never waits for it; see reap() */
+static void
+letgo(pid_t pid, int term)
+{
+	if (term)
+		kill(-pid, SIGTERM);
+	if (nchildren == childrensize) {
+		childrensize = childrensize ? childrensize * 2 : 16;
+		if (!(children = realloc(children, childrensize * sizeof *children)))
+			die("cannot realloc %zu bytes:", childrensize * sizeof *children);
+	}
+	children[nchildren].pid = pid;
+	children[nchildren].term = term;
+	clock_gettime(CLOCK_MONOTONIC, &children[nchildren++].at);
+}
+
+/* collect the children that exited; those ignoring SIGTERM for KILLMS
+ * get SIGKILL */
+static void
+reap(void)
+{
+	size_t i;
+
+	for (i = 0; i < nchildren;) {
+		if (waitpid(children[i].pid, NULL, WNOHANG) != 0) {
+			children[i] = children[--nchildren];
+			continue;
+		}
+		if (children[i].term && sincems(&children[i].at) >= KILLMS) {
+			kill(-children[i].pid, SIGKILL);
+			children[i].term = 0;
+		}
+		i++;
+	}
+}
+
 static void
 cleanup(void)
 {
 	size_t i;
 
+	if (matcher) {
+		/* the worker may be scanning the items freed below */
+		pthread_mutex_lock(&matchlock);
+		mquit = 1;
+		pthread_cond_broadcast(&matchcond);
+		pthread_mutex_unlock(&matchlock);
+		pthread_join(matchthread, NULL);
+	}
 	XUngrabKey(dpy, AnyKey, AnyModifier, root);
 	for (i = 0; i < SchemeLast; i++)
 		free(scheme[i]);
-	for (i = 0; items && items[i].text; ++i) {
-		free(items[i].text);
-		if (items[i].icon.img) {
-			imlib_context_set_image(items[i].icon.img);
-			imlib_free_image();
-		}
-	}
+	for (i = 0; i < nitems; i++)
+		freeitem(&items[i]);
 	free(items);
+	free(keyoff);
+	free(keylen);
+	free(keysig);
+	free(tiers);
+	free(exts);
+	free(extfree);
+	free(iconv);
+	for (i = 0; i < themeiconsize; i++) {
+		free(themeicons[i].name);
+		free(themeicons[i].path);
+	}
+	free(themeicons);
+	if (keys != arena && owned(keys))
+		free(keys);
+	free(arena);
+	if (genpid > 0)
+		kill(-genpid, SIGTERM);
+	for (i = 0; i < nsrcs; i++)
+		if (srcs[i].pid > 0)
+			kill(-srcs[i].pid, SIGTERM);
+	reap();
+	free(children);
+	free(watchbuf);
+	free(watchline);
 	drw_free(drw);
 	XSync(dpy, False);
 	XCloseDisplay(dpy);
 }
 
+/* fold s for case- and accent-insensitive matching into dst, which holds
+ * size bytes; returns the length of the NUL-terminated result */
+static size_t
+foldstr(const char *s, char *dst, size_t size)
+{
+	/* U+00C0 to U+017F without accents, '.' where there is none */
+	static const char latin[] =
+		"aaaaaa.ceeeeiiii.nooooo.ouuuuy..aaaaaa.ceeeeiiii.nooooo.ouuuuy.y"
+		"aaaaaaccccccccddddeeeeeeeeeegggggggghhhhiiiiiiiiii..jjkk.lllllll"
+		"lllnnnnnn...oooooo..rrrrrrssssssssttttttuuuuuuuuuuuuwwyyyzzzzzzs";
+	mbstate_t in, st;
+	char mb[MB_LEN_MAX];
+	const char *o;
+	size_t len = 0, n, k;
+	wchar_t wc;
+
+	memset(&in, 0, sizeof in);
+	memset(&st, 0, sizeof st);
+	while (*s) {
+		if ((unsigned char)*s < 0x80) {
+			if (len + 1 >= size)
+				break;
+			dst[len++] = tolower((unsigned char)*s++);
+			continue;
+		}
+		o = mb;
+		if ((n = mbrtowc(&wc, s, MB_LEN_MAX, &in)) == (size_t)-1 ||
+		    n == (size_t)-2) {
+			/* not valid in this locale; keep the byte as is */
+			memset(&in, 0, sizeof in);
+			o = s;
+			n = k = 1;
+		} else if ((wc = towlower(wc)) >= 0x300 && wc < 0x370) {
+			k = 0; /* combining marks */
+		} else if (wc == 0xdf) { /* sharp s */
+			memcpy(mb, "ss", (k = 2));
+		} else if (wc >= 0xc0 && wc < 0x180 && latin[wc - 0xc0] != '.') {
+			mb[0] = latin[wc - 0xc0];
+			k = 1;
+		} else if ((k = wcrtomb(mb, wc, &st)) == (size_t)-1) {
+			memset(&st, 0, sizeof st);
+			o = s;
+			k = n;
+		}
+		if (len + k >= size)
+			break;
+		memcpy(dst + len, o, k);
+		len += k;
+		s += n;
+	}
+	dst[len] = '\0';
+	return len;
+}
+
+/* set a bit per class of the bytes in s: one per letter and digit, one
+ * for any other ascii byte and one for bytes of multibyte characters */
+static uint64_t
+sign(const char *s, size_t len)
+{
+	uint64_t sig = 0;
+	unsigned char c;
+
+	for (; len--; s++) {
+		c = *s;
+		if (c >= 'a' && c <= 'z')
+			sig |= 1ULL << (c - 'a');
+		else if (c >= 'A' && c <= 'Z')
+			sig |= 1ULL << (26 + c - 'A');
+		else if (c >= '0' && c <= '9')
+			sig |= 1ULL << (52 + c - '0');
+		else
+			sig |= 1ULL << (c < 0x80 ? 62 : 63);
+	}
+	return sig;
+}
+
+/* parse a -nth or -with-nth list of fields and field ranges, as in 2,4-5,7-
+ * for fields 2, 4 and 5, and 7 to the last, into v; returns their number */
+static int
+parsefields(const char *spec, int (*v)[2])
+{
+	const char *p = spec;
+	char *e;
+	int n;
+
+	for (n = 0; *p; n++) {
+		if (n == FIELDS)
+			die("at most %d fields in %s", FIELDS, spec);
+		v[n][0] = v[n][1] = strtol(p, &e, 10);
+		if (*e == '-')
+			v[n][1] = isdigit((unsigned char)e[1]) ? strtol(e + 1, &e, 10) :
+			          (e++, INT_MAX);
+		if (e == p || v[n][0] < 1 || v[n][1] < v[n][0] || (*e && *e != ','))
+			die("invalid field list: %s", spec);
+		p = e + !!*e;
+	}
+	return n;
+}
+
+/* the fields of s in the n ranges r, joined by the delimiter, in *buf of
+ * *size bytes; field boundaries are found once per call in one pass */
 static char *
-cistrstr(const char *h, const char *n)
+pickfields(const char *s, int (*r)[2], int n, char **buf, size_t *size)
 {
-	size_t i;
+	static const char **start, **end;
+	static size_t fieldsize;
+	const char *sep = delim ? delim : " ", *p = s, *q;
+	size_t nf = 0, len = 0, seplen = strlen(sep), i, lo, hi;
+
+	while (delim || (p += strspn(p, " \t"), *p)) {
+		if (nf == fieldsize) {
+			fieldsize = fieldsize ? fieldsize * 2 : 16;
+			if (!(start = realloc(start, fieldsize * sizeof *start)) ||
+			    !(end = realloc(end, fieldsize * sizeof *end)))
+				die("cannot realloc %zu fields:", fieldsize);
+		}
+		start[nf] = p;
+		q = delim ? (*delim ? strstr(p, delim) : NULL) : p + strcspn(p, " \t");
+		end[nf++] = q ? q : p + strlen(p);
+		if (!q || !*q)
+			break;
+		p = q + (delim ? seplen : 0);
+	}
+	if (*size < strlen(s) * n + seplen * n + 1) {
+		*size = strlen(s) * n + seplen * n + 1;
+		if (!(*buf = realloc(*buf, *size)))
+			die("cannot realloc %zu bytes:", *size);
+	}
+	for (i = 0; i < n; i++) {
+		lo = r[i][0];
+		hi = MIN((size_t)r[i][1], nf);
+		if (lo > hi)
+			continue;
+		if (len) {
+			memcpy(*buf + len, sep, seplen);
+			len += seplen;
+		}
+		memcpy(*buf + len, start[lo - 1], end[hi - 1] - start[lo - 1]);
+		len += end[hi - 1] - start[lo - 1];
+	}
+	(*buf)[len] = '\0';
+	return *buf;
+}
+
+/* append the key of item with text s to keys; with -i it is folded once
+ * here, so matching never folds items, and with -nth only its fields are */
+static void
+setkey(struct item *item, const char *s)
+{
+	static char *buf;
+	static size_t size;
+	size_t i = item - items, len, n;
 
-	if (!n[0])
-		return (char *)h;
+	if (nnth)
+		s = pickfields(s, nth, nnth, &buf, &size);
+	len = strlen(s);
+	n = fold ? 2 * len + 1 : len + 1; /* folding at most doubles it */
 
-	for (; *h; ++h) {
-		for (i = 0; n[i] && tolower((unsigned char)n[i]) ==
-		            tolower((unsigned char)h[i]); ++i)
-			;
-		if (n[i] == '\0')
-			return (char *)h;
+	if (keyslen + n > keyssize) {
+		keyssize = MAX(keyssize * 2, keyslen + n);
+		if (keyssize > UINT32_MAX)
+			die("too much input");
+		if (!(keys = realloc(keys, keyssize)))
+			die("cannot realloc %zu bytes:", keyssize);
 	}
-	return NULL;
+	keyoff[i] = keyslen;
+	if (fold) {
+		keylen[i] = foldstr(s, keys + keyslen, n);
+	} else {
+		memcpy(keys + keyslen, s, n);
+		keylen[i] = len;
+	}
+	keysig[i] = sign(keys + keyslen, keylen[i]);
+	keyslen += keylen[i] + 1;
+}
+
+/* drop the keys of replaced and deleted items once they fill half of keys */
+static void
+compactkeys(void)
+{
+	char *k;
+	size_t i, len = 0;
+
+	if (keysgarbage < keyslen / 2 || keysgarbage < BUFSIZ)
+		return;
+	k = ecalloc(keyssize, 1);
+	for (i = 0; i < nitems; i++) {
+		if (tiers[i] == REMOVED) {
+			keyoff[i] = keylen[i] = 0;
+			continue;
+		}
+		memcpy(k + len, keys + keyoff[i], keylen[i] + 1);
+		keyoff[i] = len;
+		len += keylen[i] + 1;
+	}
+	free(keys);
+	keys = k;
+	keyslen = len;
+	keysgarbage = 0;
 }
 
 static void
@@ -212,100 +962,495 @@ cmd_output(char *cmd, char *out)
 }
 
 static int
-drawitem(struct item *item, int x, int y, int w)
+itemscheme(struct item *item)
 {
-	int ret, icmdret, icx, icy;
-	char ipath[1024];
-	char icmd[sizeof ipath * 2];
-	Imlib_Load_Error ierr;
-
-	if (item == sel)
-		drw_setscheme(drw, scheme[SchemeSel]);
-	else if (item->out)
-		drw_setscheme(drw, scheme[SchemeOut]);
-	else
-		drw_setscheme(drw, scheme[SchemeNorm]);
-
-	if (bidi) {
-		apply_fribidi(item->text);
-		ret = drw_text(drw, x, y, w, bh, lrpad / 2, icon_size, fribidi_text, 0);
-	} else {
-		ret = drw_text(drw, x, y, w, bh, lrpad / 2, icon_size, item->text, 0);
-	}
-
-	if (icon_size > 0) {
-		if (item->icon.img == NULL && !item->icon.loaded) {
-			if (item->icon.fname != NULL) { // provided using inline --icon=
-				item->icon.img =
-					load_icon_image(drw, item->icon.fname, icon_size, &ierr);
-			} else if (icon_command != NULL) { // -icmd option
-				sprintf(icmd, "%s '%s'",
-						icon_command, item->text); // TODO: escape '
-				icmdret = cmd_output(icmd, ipath); // TODO: parallelize
-				if (icmdret == 0)
-					item->icon.img =
-						load_icon_image(drw, ipath, icon_size, &ierr);
-			} else { // default
-				item->icon.img =
-					load_icon_image(drw, item->text, icon_size, &ierr);
-			}
-			if (item->icon.img == NULL)
-				item->icon.img
-					= load_icon_image(drw, icon_fallback, icon_size, &ierr);
-			item->icon.loaded = 1;
-
-			if (ierr != IMLIB_LOAD_ERROR_NONE)
-				fprintf(stderr, "warning: failed loading icon for %s\n",
-						item->text);
-		}
-
-		if (icon_size > w)
-			die("window width is too small or icons size is too large");
+	if (item == selected())
+		return SchemeSel;
+	return item->out ? SchemeOut : SchemeNorm;
+}
 
-		icx = x + ((w - icon_size) / 2);
-		icy = y + 2;
-		if (item->icon.img != NULL && item->icon.loaded) {
-			drw_icon(drw, item->icon, icx, icy);
-		} else
-			drw_rect(drw, icx, icy, icon_size, icon_size, 0, 0);
-	}
+/* start the icon clock over long before it could wrap around, forgetting
+ * which icons were used last */
+static void
+iconrewind(void)
+{
+	size_t i;
 
-	return ret;
+	if (iconclock < UINT32_MAX / 2)
+		return;
+	for (i = 0; i < niconv; i++)
+		iconv[i].used = 0;
+	iconclock = 0;
 }
 
+/* stamp the icon of item as used now */
 static void
-recalculatenumbers()
+iconuse(struct item *item)
 {
-	return; // TODO: bring back later
-	unsigned int numer = 0, denom = 0;
-	struct item *item;
-	if (matchend) {
-		numer++;
-		for (item = matchend; item && item->left; item = item->left)
-			numer++;
-	}
-	for (item = items; item && item->text; item++)
-		denom++;
-	snprintf(numbers, NUMBERSBUFSIZE, "%d/%d", numer, denom);
+	if (item->iconslot)
+		iconv[item->iconslot - 1].used = ++iconclock;
 }
 
+/* keep img, the icon just loaded for item, then free the least recently
+ * used icons out of view for as long as the icons exceed the -icache
+ * budget */
 static void
-drawmenu(void)
+iconkeep(struct item *item, Imlib_Image img)
 {
-	unsigned int curpos;
-	struct item *item;
-	int x = 0, y = 0, w;
-	char *censort;
+	struct icon *lru;
+	uint32_t frame;
+	size_t i, end;
+
+	if (niconv == iconvsize) {
+		iconvsize = iconvsize ? iconvsize * 2 : 64;
+		if (!(iconv = realloc(iconv, iconvsize * sizeof *iconv)))
+			die("cannot realloc %zu bytes:", iconvsize * sizeof *iconv);
+	}
+	iconv[niconv].img = img;
+	iconv[niconv].item = item - items;
+	item->iconslot = ++niconv;
+	iconbytes += ICONBYTES;
+	iconrewind();
+	frame = iconclock;
+	iconuse(item);
+	if (iconbytes <= (size_t)icon_cache << 20)
+		return;
+	for (i = curr, end = visibleend(); i < end; i++)
+		iconuse(matchat(i));
+	while (iconbytes > (size_t)icon_cache << 20) {
+		for (lru = NULL, i = 0; i < niconv; i++)
+			if (iconv[i].used <= frame &&
+			    (!lru || iconv[i].used < lru->used))
+				lru = &iconv[i];
+		if (!lru)
+			break; /* the view alone is over budget */
+		icondrop(&items[lru->item]);
+	}
+}
+
+static struct themeicon *
+themefind(const char *name)
+{
+	size_t i;
+
+	for (i = hashstr(name) & (themeiconsize - 1); themeicons[i].name;
+	     i = (i + 1) & (themeiconsize - 1))
+		if (!strcmp(themeicons[i].name, name))
+			break;
+	return &themeicons[i];
+}
+
+/* offer path as the file of icon name, kept if it ranks better */
+static void
+themeput(const char *name, const char *path, unsigned long rank)
+{
+	struct themeicon *t, *old = themeicons;
+	size_t i, oldsize = themeiconsize;
+
+	if (2 * (nthemeicons + 1) > themeiconsize) {
+		themeiconsize = themeiconsize ? themeiconsize * 2 : 1024;
+		themeicons = ecalloc(themeiconsize, sizeof *themeicons);
+		for (i = 0; i < oldsize; i++)
+			if (old[i].name)
+				*themefind(old[i].name) = old[i];
+		free(old);
+	}
+	if (!(t = themefind(name))->name) {
+		t->name = estrdup(name);
+		nthemeicons++;
+	} else if (t->rank <= rank) {
+		return;
+	}
+	free(t->path);
+	t->path = estrdup(path);
+	t->rank = rank;
+}
+
+/* add the icons in directory dir; an icon ranks by the theme it is in,
+ * then png or xpm before svg, then by how far its size is from icon_size,
+ * larger before smaller */
+static void
+themescan(const char *dir, int depth, int dist, int size)
+{
+	char path[PATH_MAX], name[NAME_MAX + 1], *ext;
+	struct dirent *de;
+	DIR *d;
+	int svg;
+
+	if (!(d = opendir(dir)))
+		return;
+	while ((de = readdir(d))) {
+		if (!(ext = strrchr(de->d_name, '.')) || (strcmp(ext, ".png") &&
+		    strcmp(ext, ".xpm") && strcmp(ext, ".svg")))
+			continue;
+		svg = !strcmp(ext, ".svg");
+		memcpy(name, de->d_name, ext - de->d_name);
+		name[ext - de->d_name] = '\0';
+		if (snprintf(path, sizeof path, "%s/%s", dir, de->d_name) >= sizeof path)
+			continue;
+		themeput(name, path, (unsigned long)depth << 24 | svg << 23 |
+		         MIN(dist, 0x3fffff) << 1 | (size < (int)icon_size));
+	}
+	closedir(d);
+}
+
+/* read the index.theme of theme from the first base directory having it,
+ * scan its directories in every base and return its Inherits list */
+static char *
+themeread(char **bases, const char *theme, int depth)
+{
+	char path[PATH_MAX], line[BUFSIZ], sect[BUFSIZ] = "", *inherits = NULL;
+	char *p, *v;
+	FILE *fp = NULL;
+	int i, size = 0, min = 0, max = 0, threshold = 2, scale = 1, dist;
+	char type = 'T';
+
+	for (i = 0; bases[i] && !fp; i++)
+		if (snprintf(path, sizeof path, "%s/%s/index.theme",
+		             bases[i], theme) < sizeof path)
+			fp = fopen(path, "r");
+	if (!fp)
+		return NULL;
+	/* a section ends at the next one, the extra pass flushes the last */
+	for (;;) {
+		p = fgets(line, sizeof line, fp);
+		if ((!p || line[0] == '[') && size && scale == 1) {
+			if (type == 'F')
+				dist = abs(size - (int)icon_size);
+			else if (type == 'S')
+				dist = (int)icon_size < min ? min - (int)icon_size :
+				       (int)icon_size > max ? (int)icon_size - max : 0;
+			else
+				dist = MAX(abs(size - (int)icon_size) - threshold, 0);
+			for (i = 0; bases[i]; i++)
+				if (snprintf(path, sizeof path, "%s/%s/%s", bases[i],
+				             theme, sect) < sizeof path)
+					themescan(path, depth, dist, size);
+		}
+		if (!p)
+			break;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '[') {
+			if ((p = strchr(line, ']')))
+				*p = '\0';
+			strcpy(sect, line + 1);
+			size = min = max = 0;
+			threshold = 2;
+			scale = 1;
+			type = 'T';
+			continue;
+		}
+		if (!(v = strchr(line, '=')))
+			continue;
+		*v++ = '\0';
+		if (!strcmp(sect, "Icon Theme")) {
+			if (!strcmp(line, "Inherits") && !inherits)
+				inherits = estrdup(v);
+		} else if (!strcmp(line, "Size")) {
+			size = atoi(v);
+			min = min ? min : size;
+			max = max ? max : size;
+		} else if (!strcmp(line, "MinSize")) {
+			min = atoi(v);
+		} else if (!strcmp(line, "MaxSize")) {
+			max = atoi(v);
+		} else if (!strcmp(line, "Threshold")) {
+			threshold = atoi(v);
+		} else if (!strcmp(line, "Scale")) {
+			scale = atoi(v);
+		} else if (!strcmp(line, "Type")) {
+			type = v[0];
+		}
+	}
+	fclose(fp);
+	return inherits;
+}
+
+/* index the -itheme theme, the themes it inherits and hicolor once,
+ * keeping the best file of every icon name */
+static void
+themeindex(void)
+{
+	char *bases[64], *themes[64], *inherits, *home = getenv("HOME");
+	char *dirs, *d, *sp, buf[PATH_MAX];
+	size_t nbases = 0, nthemes = 0, i, j;
+
+	if (home && snprintf(buf, sizeof buf, "%s/.icons", home) < sizeof buf)
+		bases[nbases++] = estrdup(buf);
+	if ((d = getenv("XDG_DATA_HOME")) && *d) {
+		if (snprintf(buf, sizeof buf, "%s/icons", d) < sizeof buf)
+			bases[nbases++] = estrdup(buf);
+	} else if (home && snprintf(buf, sizeof buf, "%s/.local/share/icons",
+	                            home) < sizeof buf) {
+		bases[nbases++] = estrdup(buf);
+	}
+	if (!(d = getenv("XDG_DATA_DIRS")) || !*d)
+		d = "/usr/local/share:/usr/share";
+	dirs = estrdup(d);
+	for (d = strtok_r(dirs, ":", &sp); d && nbases < LENGTH(bases) - 1;
+	     d = strtok_r(NULL, ":", &sp))
+		if (snprintf(buf, sizeof buf, "%s/icons", d) < sizeof buf)
+			bases[nbases++] = estrdup(buf);
+	free(dirs);
+	bases[nbases] = NULL;
+
+	themes[nthemes++] = estrdup(icon_theme);
+	for (i = 0; i <= nthemes && i < LENGTH(themes); i++) {
+		if (i == nthemes) {
+			/* every theme falls back to hicolor last */
+			for (j = 0; j < nthemes && strcmp(themes[j], "hicolor"); j++)
+				;
+			if (j < nthemes)
+				break;
+			themes[nthemes++] = estrdup("hicolor");
+		}
+		if (!(inherits = themeread(bases, themes[i], i)))
+			continue;
+		for (d = strtok_r(inherits, ",", &sp); d && nthemes < LENGTH(themes);
+		     d = strtok_r(NULL, ",", &sp)) {
+			for (j = 0; j < nthemes && strcmp(themes[j], d); j++)
+				;
+			if (j == nthemes)
+				themes[nthemes++] = estrdup(d);
+		}
+		free(inherits);
+	}
+	/* unthemed icons come last */
+	themescan("/usr/share/pixmaps", nthemes, 0, icon_size);
+	for (i = 0; i < nthemes; i++)
+		free(themes[i]);
+	for (i = 0; i < nbases; i++)
+		free(bases[i]);
+}
+
+/* the file of icon name in the -itheme theme; paths and names the theme
+ * lacks are returned as they are */
+static const char *
+themed(const char *name)
+{
+	struct themeicon *t;
+
+	if (!icon_theme || !name || strchr(name, '/'))
+		return name;
+	if (!themeiconsize)
+		themeindex();
+	if (!themeiconsize || !(t = themefind(name))->name)
+		return name;
+	return t->path;
+}
+
+static void
+iconload(struct item *item)
+{
+	int icmdret;
+	char ipath[1024];
+	char icmd[sizeof ipath * 2];
+	Imlib_Load_Error ierr;
+	Imlib_Image img = NULL;
+
+	if (itemext(item)->icon != NULL) { // provided using inline --icon=
+		img = load_icon_image(drw, themed(itemext(item)->icon), icon_size, &ierr);
+	} else if (icon_command != NULL) { // -icmd option
+		sprintf(icmd, "%s '%s'",
+				icon_command, itemtext(item)); // TODO: escape '
+		icmdret = cmd_output(icmd, ipath); // TODO: parallelize
+		if (icmdret == 0)
+			img = load_icon_image(drw, ipath, icon_size, &ierr);
+	} else { // default
+		img = load_icon_image(drw, themed(itemtext(item)), icon_size, &ierr);
+	}
+	if (img == NULL)
+		img = load_icon_image(drw, themed(icon_fallback), icon_size, &ierr);
+	item->iconloaded = 1;
+
+	if (ierr != IMLIB_LOAD_ERROR_NONE)
+		fprintf(stderr, "warning: failed loading icon for %s\n",
+				itemtext(item));
+	if (img)
+		iconkeep(item, img);
+}
+
+/* load one icon of the page past the view in the direction the grid last
+ * scrolled, so it is there once scrolled to; returns 0 if none is left */
+static int
+prefetch(void)
+{
+	size_t i, end, page = lines * columns, fit;
+
+	if (icon_size <= 0 || !nmatches)
+		return 0;
+	/* never evict what the view needs for icons it may not */
+	fit = ((size_t)icon_cache << 20) / ICONBYTES;
+	page = MIN(page, fit > page ? fit - page : 0);
+	if (scrolldir > 0) {
+		for (i = visibleend(), end = MIN(i + page, nmatches); i < end; i++)
+			if (!matchat(i)->iconloaded)
+				break;
+		if (i == end)
+			return 0;
+	} else {
+		for (i = curr, end = curr - MIN(curr, page); i > end; i--)
+			if (!matchat(i - 1)->iconloaded)
+				break;
+		if (i-- == end)
+			return 0;
+	}
+	iconload(matchat(i));
+	return 1;
+}
+
+static int
+drawitem(struct item *item, int x, int y, int w)
+{
+	int ret, icx, icy;
+	Imlib_Image img;
+
+	drw_setscheme(drw, scheme[itemscheme(item)]);
+
+	if (bidi) {
+		apply_fribidi(itemtext(item));
+		ret = drw_text(drw, x, y, w, bh, lrpad / 2, icon_size, fribidi_text, 0);
+	} else {
+		ret = drw_text(drw, x, y, w, bh, lrpad / 2, icon_size, itemtext(item), 0);
+	}
+
+	if (icon_size > 0) {
+		if (!item->iconloaded)
+			iconload(item);
+
+		if (icon_size > w)
+			die("window width is too small or icons size is too large");
+
+		icx = x + ((w - icon_size) / 2);
+		icy = y + 2;
+		if ((img = itemicon(item)) != NULL) {
+			drw_icon(drw, img, icx, icy);
+		} else
+			drw_rect(drw, icx, icy, icon_size, icon_size, 0, 0);
+	}
+
+	return ret;
+}
+
+static void
+recalculatenumbers()
+{
+	snprintf(numbers, NUMBERSBUFSIZE, "%zu/%zu", nmatches, nitems - nremoved);
+}
+
+/* drop the least recently used tile */
+static void
+tileevict(void)
+{
+	struct tile *t, *lru = tiles;
+
+	for (t = tiles; t < tiles + ntiles; t++)
+		if (t->used < lru->used)
+			lru = t;
+	tilefree(lru);
+}
+
+/* draw a grid cell, from its tile if it was rendered before */
+static void
+drawcell(size_t i)
+{
+	struct item *item = matchat(i);
+	struct tile *t;
+	const char *key;
+	uint32_t *p;
+	int w = (mw - promptw) / columns, sch = itemscheme(item);
+	int x = promptw + (i % columns) * w;
+	int y = bh - icon_size + (i / columns) * bh - scrolly;
+	size_t bytes = (size_t)w * bh * 4;
+
+	iconrewind();
+	iconuse(item);
+	/* an icon that is not loaded yet has to go through drawitem() */
+	if ((icon_size <= 0 || item->iconloaded) && tileh.size) {
+		key = tilekey(itemtext(item), sch, w, itemicon(item));
+		if (*(p = hfind(&tileh, key))) {
+			t = &tiles[*p - 1];
+			drw_restore(drw, t->pm, x, y, w, bh);
+			t->used = ++tileclock;
+			return;
+		}
+	}
+	drawitem(item, x, y, w);
+	/* only cells drawn whole can be kept */
+	if (y < 0 || y + bh > mh || bytes > TILEBYTES)
+		return;
+	while (ntiles == LENGTH(tiles) || tilebytes + bytes > TILEBYTES)
+		tileevict();
+	t = &tiles[ntiles++];
+	key = tilekey(itemtext(item), sch, w, itemicon(item));
+	if (!(t->key = strdup(key)))
+		die("cannot strdup %zu bytes:", strlen(key) + 1);
+	t->icon = itemicon(item);
+	t->w = w;
+	t->pm = drw_save(drw, x, y, w, bh);
+	t->used = ++tileclock;
+	tilebytes += bytes;
+	hput(&tileh, t - tiles);
+}
+
+/* match position of the grid cell at window point x, y, or nmatches */
+static size_t
+gridcell(int x, int y)
+{
+	int w = (mw - promptw) / columns, y0 = bh - icon_size;
+	size_t i;
+
+	if (x < promptw || y < y0 || y >= mh || !w)
+		return nmatches;
+	i = (y - y0 + scrolly) / bh * columns + MIN((x - promptw) / w, columns - 1);
+	return MIN(i, nmatches);
+}
+
+/* draw the grid rows that intersect the window rows top to bottom */
+static void
+drawgrid(int top, int bottom)
+{
+	int y0 = bh - icon_size;
+	size_t i, end;
 
 	drw_setscheme(drw, scheme[SchemeNorm]);
-	drw_rect(drw, 0, 0, mw, mh, 1, 1);
+	drw_rect(drw, 0, top, mw, bottom - top, 1, 1);
+	i = (top - y0 + scrolly) / bh * columns;
+	end = MIN(((bottom - 1 - y0 + scrolly) / bh + 1) * columns, nmatches);
+	for (; i < end; i++)
+		drawcell(i);
+}
+
+static void
+drawscrollbar(void)
+{
+	int y = bh - icon_size, h = lines * bh, max = maxscroll(), th;
+
+	if (!max || !scrollbar_width)
+		return;
+	th = MAX((int)((double)h * h / (h + max)), lrpad);
+	drw_setscheme(drw, scheme[SchemeBorder]);
+	drw_rect(drw, mw - scrollbar_width, y, scrollbar_width, h, 1, 0);
+	drw_setscheme(drw, scheme[SchemeSel]);
+	drw_rect(drw, mw - scrollbar_width, y + (int)((double)(h - th) * scrolly / max),
+	         scrollbar_width, th, 1, 1);
+}
+
+/* draw the prompt and input line, and the horizontal list if any */
+static void
+drawinput(void)
+{
+	unsigned int curpos;
+	size_t i;
+	int x = 0, w;
+	char *censort;
 
 	if (prompt && *prompt) {
 		drw_setscheme(drw, scheme[SchemeSel]);
 		x = drw_text(drw, x, 0, promptw, bh - icon_size, lrpad / 2, 0, prompt, 0);
 	}
 	/* draw input field */
-	w = (lines > 0 || !matches) ? mw - x : inputw;
+	w = (lines > 0 || !nmatches) ? mw - x : inputw;
 	drw_setscheme(drw, scheme[SchemeNorm]);
 	if (passwd) {
 	        censort = ecalloc(1, sizeof(text));
@@ -328,30 +1473,20 @@ drawmenu(void)
 	}
 
 	recalculatenumbers();
-	if (lines > 0) {
-		/* draw grid */
-		int i = 0;
-		for (item = curr; item != next; item = item->right, i++)
-			drawitem(
-				item,
-				x + ((i % columns) * ((mw - x) / columns)),
-				y + (((i / columns) + 1) *  bh) - icon_size,
-				(mw - x) / columns
-			);
-	} else if (matches) {
+	if (lines == 0 && nmatches) {
 		/* draw horizontal list */
 		x += inputw;
 		w = TEXTW("<");
-		if (curr->left) {
+		if (curr > 0) {
 			drw_setscheme(drw, scheme[SchemeNorm]);
 			drw_text(drw, x, 0, w, bh, lrpad / 2, 0, "<", 0);
 		}
 		x += w;
-		for (item = curr; item != next; item = item->right)
-			x = drawitem(item, x, 0,
-						 textw_clamp(item->text,
+		for (i = curr; i < next; i++)
+			x = drawitem(matchat(i), x, 0,
+						 textw_clamp(itemtext(matchat(i)),
 									 mw - x - TEXTW(">")- TEXTW(numbers)));
-		if (next) {
+		if (next < nmatches) {
 			w = TEXTW(">");
 			drw_setscheme(drw, scheme[SchemeNorm]);
 			drw_text(drw, mw - w - TEXTW(numbers),
@@ -362,160 +1497,1214 @@ drawmenu(void)
 	drw_setscheme(drw, scheme[SchemeNorm]);
 	drw_text(drw, mw - TEXTW(numbers), 0,
 			 TEXTW(numbers), bh - icon_size, lrpad / 2, 0, numbers, 0);
+}
+
+static void
+drawmenu(void)
+{
+	drw_setscheme(drw, scheme[SchemeNorm]);
+	drw_rect(drw, 0, 0, mw, mh, 1, 1);
+
+	/* the grid goes first so the input line covers a partly scrolled row */
+	if (lines > 0) {
+		drawgrid(bh - icon_size, mh);
+		drawscrollbar();
+		drawny = scrolly;
+		prefetching = 1;
+	}
+	drawinput();
+	drw_map(drw, win, 0, 0, mw, mh);
+}
+
+/* redraw after the grid scrolled: rows still in view are shifted in the
+ * pixmap and only the rows that scrolled in are drawn */
+static void
+drawscroll(size_t oldsel)
+{
+	int y0 = bh - icon_size, h = lines * bh, dy = scrolly - drawny;
+
+	if (dy)
+		scrolldir = dy > 0 ? 1 : -1;
+	prefetching = 1;
+	if (drawny < 0 || dy >= h || -dy >= h) {
+		drawmenu();
+		return;
+	}
+	if (dy > 0) {
+		drw_copy(drw, 0, y0 + dy, mw, h - dy, 0, y0);
+		drawgrid(mh - dy, mh);
+	} else if (dy < 0) {
+		drw_copy(drw, 0, y0, mw, h + dy, 0, y0 - dy);
+		drawgrid(y0, y0 - dy);
+	}
+	if (oldsel != sel && nmatches) {
+		if (oldsel >= curr && oldsel < visibleend())
+			drawcell(oldsel);
+		drawcell(sel);
+	}
+	drawscrollbar();
+	drawinput();
+	drawny = scrolly;
 	drw_map(drw, win, 0, 0, mw, mh);
 }
 
+/* ease the grid towards scrollto, dragging the selection along */
+static void
+scrollstep(void)
+{
+	size_t oldsel = sel, row, top, bottom;
+	int d = scrollto - scrolly;
+
+	scrolly += d / 4 ? d / 4 : (d > 0) - (d < 0);
+	calcoffsets();
+	if (nmatches) {
+		top = (scrolly + bh - 1) / bh;
+		bottom = MAX(top, (scrolly + lines * bh) / bh - 1);
+		row = sel / columns;
+		if (row < top)
+			sel += (top - row) * columns;
+		else if (row > bottom)
+			sel -= (row - bottom) * columns;
+		sel = MIN(sel, nmatches - 1);
+	}
+	drawscroll(oldsel);
+}
+
+/* sleep until the X server sends something or ms pass, then double ms
+ * up to 16; returns 0 once GRABMS have passed since start */
+static int
+grabwait(const struct timespec *start, int *ms)
+{
+	struct pollfd pfd = { .fd = ConnectionNumber(dpy), .events = POLLIN };
+
+	if (sincems(start) >= GRABMS)
+		return 0;
+	XFlush(dpy);
+	poll(&pfd, 1, *ms);
+	*ms = MIN(*ms * 2, 16);
+	return 1;
+}
+
 static void
 grabfocus(void)
 {
-	struct timespec ts = { .tv_sec = 0, .tv_nsec = 10000000  };
+	struct timespec start;
+	XWindowAttributes wa;
 	Window focuswin;
-	int i, revertwin;
+	int revertwin, ms = 1;
 
-	for (i = 0; i < 100; ++i) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
 		XGetInputFocus(dpy, &focuswin, &revertwin);
 		if (focuswin == win)
 			return;
-		XSetInputFocus(dpy, win, RevertToParent, CurrentTime);
-		nanosleep(&ts, NULL);
-	}
+		/* focusing a window that is not viewable is an error; the
+		 * VisibilityNotify once it is ends the wait, as does FocusIn */
+		if (XGetWindowAttributes(dpy, win, &wa) && wa.map_state == IsViewable)
+			XSetInputFocus(dpy, win, RevertToParent, CurrentTime);
+	} while (grabwait(&start, &ms));
 	die("cannot grab focus");
 }
 
 static void
 grabkeyboard(void)
 {
-	struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000  };
-	int i;
+	struct timespec start;
+	XEvent ev;
+	int ms = 1, ok;
 
 	if (embed || managed)
 		return;
-	/* try to grab keyboard, we may have to wait for another process to ungrab */
-	for (i = 0; i < 1000; i++) {
-		if (XGrabKeyboard(dpy, DefaultRootWindow(dpy), True, GrabModeAsync,
-		                  GrabModeAsync, CurrentTime) == GrabSuccess)
-			return;
-		nanosleep(&ts, NULL);
-	}
-	die("cannot grab keyboard");
+	/* another client may hold the keyboard; X tells nobody when it lets
+	 * go, but focus moving back to the root window while we wait ends
+	 * the wait early, and waits grow from 1 ms otherwise */
+	XSelectInput(dpy, root, FocusChangeMask);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!(ok = XGrabKeyboard(dpy, root, True, GrabModeAsync, GrabModeAsync,
+	                            CurrentTime) == GrabSuccess) &&
+	       grabwait(&start, &ms))
+		;
+	XSelectInput(dpy, root, NoEventMask);
+	while (XCheckWindowEvent(dpy, root, FocusChangeMask, &ev))
+		;
+	if (!ok)
+		die("cannot grab keyboard");
 }
 
-static void
-match(void)
+/* fold a byte into one of 64 classes: letters ignoring case, digits,
+ * and the remaining bytes hashed together; the index only has to
+ * produce a superset of the real matches */
+static unsigned int
+triclass(unsigned char c)
 {
-	static char **tokv = NULL;
-	static int tokn = 0;
-
-	char buf[sizeof text], *s;
-	int i, tokc = 0;
-	size_t len, textsize;
-	struct item *item, *lprefix, *lsubstr, *prefixend, *substrend;
-
-	strcpy(buf, text);
-	/* separate input text into tokens to be matched individually */
-	for (s = strtok(buf, " "); s; tokv[tokc - 1] = s, s = strtok(NULL, " "))
-		if (++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
-			die("cannot realloc %zu bytes:", tokn * sizeof *tokv);
-	len = tokc ? strlen(tokv[0]) : 0;
-
-	matches = lprefix = lsubstr = matchend = prefixend = substrend = NULL;
-	textsize = strlen(text) + 1;
-	for (item = items; item && item->text; item++) {
-		for (i = 0; i < tokc; i++)
-			if (!fstrstr(item->text, tokv[i]))
-				break;
-		if (i != tokc) /* not all tokens match */
-			continue;
-		/* exact matches go first, then prefixes, then substrings */
-		if (!tokc || !fstrncmp(text, item->text, textsize))
-			appenditem(item, &matches, &matchend);
-		else if (!fstrncmp(tokv[0], item->text, len))
-			appenditem(item, &lprefix, &prefixend);
-		else
-			appenditem(item, &lsubstr, &substrend);
-	}
-	if (lprefix) {
-		if (matches) {
-			matchend->right = lprefix;
-			lprefix->left = matchend;
-		} else
-			matches = lprefix;
-		matchend = prefixend;
-	}
-	if (lsubstr) {
-		if (matches) {
-			matchend->right = lsubstr;
-			lsubstr->left = matchend;
-		} else
-			matches = lsubstr;
-		matchend = substrend;
-	}
-	curr = sel = matches;
-	calcoffsets();
+	if (c >= 'A' && c <= 'Z')
+		c += 'a' - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a';
+	if (c >= '0' && c <= '9')
+		return 26 + c - '0';
+	return 36 + c % 28;
 }
 
-static void
-insert(const char *str, ssize_t n)
+static unsigned int
+trikey(const char *s)
 {
-	if (strlen(text) + n > sizeof text - 1)
-		return;
-	/* move existing text out of the way, insert new text, and update cursor */
-	memmove(&text[cursor + n], &text[cursor], sizeof text - cursor - MAX(n, 0));
-	if (n > 0)
-		memcpy(&text[cursor], str, n);
-	cursor += n;
-	match();
+	return triclass(s[0]) << (2 * TRIBITS) | triclass(s[1]) << TRIBITS |
+	       triclass(s[2]);
 }
 
 static size_t
-nextrune(int inc)
+varintlen(uint32_t v)
 {
-	ssize_t n;
+	size_t n;
 
-	/* return location of next utf8 rune in the given direction (+1 or -1) */
-	for (n = cursor + inc; n + inc >= 0 && (text[n] & 0xc0) == 0x80; n += inc)
-		;
+	for (n = 1; v >= 0x80; v >>= 7)
+		n++;
 	return n;
 }
 
 static void
-movewordedge(int dir)
+tribuild(void)
 {
-	if (dir < 0) { /* move cursor to the start of the word*/
-		while (cursor > 0 && strchr(worddelimiters, text[nextrune(-1)]))
-			cursor = nextrune(-1);
-		while (cursor > 0 && !strchr(worddelimiters, text[nextrune(-1)]))
-			cursor = nextrune(-1);
-	} else { /* move cursor to the end of the word */
-		while (text[cursor] && strchr(worddelimiters, text[cursor]))
-			cursor = nextrune(+1);
-		while (text[cursor] && !strchr(worddelimiters, text[cursor]))
-			cursor = nextrune(+1);
+	uint32_t *last;
+	uint64_t *w;
+	const char *p;
+	size_t i, k, pass;
+	uint32_t d;
+
+	last = ecalloc(NTRI, sizeof *last);
+	w = ecalloc(NTRI, sizeof *w);
+	tri.cnt = ecalloc(NTRI, sizeof *tri.cnt);
+	tri.off = ecalloc(NTRI + 1, sizeof *tri.off);
+	tri.n = nitems;
+	/* the first pass sizes every posting list, the second one fills them */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < nitems; i++) {
+			for (p = searchkey(&items[i]); p[0] && p[1] && p[2]; p++) {
+				k = trikey(p);
+				if (last[k] == i + 1)
+					continue;
+				d = i + 1 - last[k];
+				last[k] = i + 1;
+				if (!pass) {
+					tri.cnt[k]++;
+					tri.off[k + 1] += varintlen(d);
+					continue;
+				}
+				for (; d >= 0x80; d >>= 7)
+					tri.post[w[k]++] = d | 0x80;
+				tri.post[w[k]++] = d;
+			}
+		}
+		if (pass)
+			break;
+		for (k = 0; k < NTRI; k++) {
+			w[k] = tri.off[k];
+			tri.off[k + 1] += tri.off[k];
+		}
+		memset(last, 0, NTRI * sizeof *last);
+		tri.post = ecalloc(tri.off[NTRI] + 1, 1);
 	}
+	free(last);
+	free(w);
 }
 
-static void
-keypress(XKeyEvent *ev)
+static uint64_t
+texthash(void)
 {
-	char buf[32];
-	int len;
-	KeySym ksym;
-	Status status;
-	int i, offscreen = 0;
-	struct item *tmpsel;
+	uint64_t h = 14695981039346656037ULL;
+	const char *p;
+	size_t i;
 
-	len = XmbLookupString(xic, ev, buf, sizeof buf, &ksym, &status);
-	switch (status) {
-	default: /* XLookupNone, XBufferOverflow */
-		return;
-	case XLookupChars:
-		goto insert;
-	case XLookupKeySym:
-	case XLookupBoth:
-		break;
+	for (i = 0; i < nitems; i++) {
+		for (p = searchkey(&items[i]); *p; p++)
+			h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+		h = (h ^ '\n') * 1099511628211ULL;
 	}
+	return h;
+}
 
-	if (ev->state & ControlMask) {
+/* whether the posting list offsets of a loaded index ascend and end at
+ * postlen; the lists themselves are checked as trifilter() reads them */
+static int
+trioffok(uint64_t postlen)
+{
+	size_t k;
+
+	for (k = 0; k < NTRI; k++)
+		if (tri.off[k] > tri.off[k + 1])
+			return 0;
+	return tri.off[NTRI] == postlen;
+}
+
+static int
+triload(uint64_t hash)
+{
+	struct trihdr *h;
+	struct stat st;
+	size_t len;
+	char *m;
+	int fd;
+
+	if ((fd = open(trifile, O_RDONLY)) < 0)
+		return 0;
+	m = (fstat(fd, &st) < 0 || st.st_size < sizeof *h) ? MAP_FAILED :
+	    mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return 0;
+	h = (struct trihdr *)m;
+	len = sizeof *h + NTRI * sizeof *tri.cnt + (NTRI + 1) * sizeof *tri.off;
+	if (memcmp(h->magic, "dmtri01\n", sizeof h->magic) || h->n != nitems ||
+	    h->hash != hash || st.st_size != len + h->postlen) {
+		munmap(m, st.st_size);
+		return 0;
+	}
+	tri.map = m;
+	tri.maplen = st.st_size;
+	tri.n = h->n;
+	tri.cnt = (uint32_t *)(m + sizeof *h);
+	tri.off = (uint64_t *)(m + sizeof *h + NTRI * sizeof *tri.cnt);
+	tri.post = (unsigned char *)m + len;
+	if (!trioffok(h->postlen)) {
+		munmap(m, st.st_size);
+		memset(&tri, 0, sizeof tri);
+		return 0;
+	}
+	return 1;
+}
+
+static void
+trisave(uint64_t hash)
+{
+	struct trihdr h = { "dmtri01\n", nitems, hash, tri.off[NTRI] };
+	char tmp[PATH_MAX];
+	FILE *fp;
+	int ok;
+
+	if (snprintf(tmp, sizeof tmp, "%s.%d", trifile, (int)getpid()) >= sizeof tmp ||
+	    !(fp = fopen(tmp, "wb"))) {
+		fprintf(stderr, "warning: cannot write trigram index %s\n", trifile);
+		return;
+	}
+	ok = fwrite(&h, sizeof h, 1, fp) == 1 &&
+	     fwrite(tri.cnt, sizeof *tri.cnt, NTRI, fp) == NTRI &&
+	     fwrite(tri.off, sizeof *tri.off, NTRI + 1, fp) == NTRI + 1 &&
+	     fwrite(tri.post, 1, h.postlen, fp) == h.postlen;
+	if (fclose(fp) || !ok || rename(tmp, trifile)) {
+		fprintf(stderr, "warning: cannot write trigram index %s\n", trifile);
+		unlink(tmp);
+	}
+}
+
+/* load the index from the sidecar file if it matches the items, or build
+ * it (and refresh the sidecar) */
+static void
+triindex(void)
+{
+	uint64_t hash = 0;
+
+	tricand = ecalloc(nitems + 1, sizeof *tricand);
+	if (trifile && triload(hash = texthash()))
+		return;
+	tribuild();
+	if (trifile)
+		trisave(hash);
+}
+
+/* identifies the fonts item widths are measured with */
+static uint64_t
+fonthash(void)
+{
+	uint64_t h = 14695981039346656037ULL;
+	const char *p;
+	size_t i;
+
+	for (i = 0; i < LENGTH(fonts); i++)
+		for (p = fonts[i]; p && *p; p++)
+			h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+	return (h ^ drw->fonts->h) * 1099511628211ULL;
+}
+
+/* identifies the -d, -nth and -with-nth options */
+static uint64_t
+fieldhash(void)
+{
+	uint64_t h = 14695981039346656037ULL;
+	const unsigned char *p;
+	size_t i;
+
+	for (p = (const unsigned char *)(delim ? delim : ""); *p; p++)
+		h = (h ^ *p) * 1099511628211ULL;
+	h = (h ^ !!delim) * 1099511628211ULL;
+	for (p = (const unsigned char *)nth, i = 0; i < nnth * sizeof *nth; i++)
+		h = (h ^ p[i]) * 1099511628211ULL;
+	h = (h ^ nnth) * 1099511628211ULL;
+	for (p = (const unsigned char *)wnth, i = 0; i < nwnth * sizeof *wnth; i++)
+		h = (h ^ p[i]) * 1099511628211ULL;
+	return (h ^ nwnth) * 1099511628211ULL;
+}
+
+/* pad a snapshot region of len bytes to 8 bytes */
+static int
+snappad(FILE *fp, uint64_t len)
+{
+	static const char pad[8];
+
+	return fwrite(pad, 1, SNAPALIGN(len) - len, fp) == SNAPALIGN(len) - len;
+}
+
+/* write the parsed items, their keys, text widths and trigram index to
+ * snapout, to be mapped again by snapload() */
+static void
+snapsave(void)
+{
+	struct snaphdr h = { "dmsnap1\n", 0, 0, 0, 0, 0, 0, 0, 0 };
+	const struct itemext *e;
+	char tmp[PATH_MAX], *f[4];
+	uint32_t *off, *w, *fields;
+	size_t i, j;
+	FILE *fp;
+	int ok;
+
+	off = ecalloc(nitems + 1, sizeof *off);
+	w = ecalloc(nitems + 1, sizeof *w);
+	fields = ecalloc(4 * nitems + 1, sizeof *fields);
+	h.n = nitems;
+	h.font = fonthash();
+	h.fold = fold;
+	h.fields = fieldhash();
+	h.tri = tri.off != NULL;
+	h.postlen = h.tri ? tri.off[NTRI] : 0;
+	for (i = 0; i < nitems; i++) {
+		off[i] = h.keyslen;
+		h.keyslen += keylen[i] + 1;
+		w[i] = drw_fontset_getwidth(drw, itemtext(&items[i]));
+		e = itemext(&items[i]);
+		f[0] = items[i].text;
+		f[1] = e->value;
+		f[2] = e->id;
+		f[3] = e->icon;
+		for (j = 0; j < 4; j++) {
+			if (!f[j] || (j == 0 && !keyapart()))
+				continue;
+			fields[4 * i + j] = h.strslen + 1;
+			h.strslen += strlen(f[j]) + 1;
+		}
+		if (h.keyslen >= UINT32_MAX || h.strslen >= UINT32_MAX)
+			die("too much input for a snapshot");
+	}
+	if (snprintf(tmp, sizeof tmp, "%s.%d", snapout, (int)getpid()) >= sizeof tmp ||
+	    !(fp = fopen(tmp, "wb")))
+		die("cannot write snapshot %s:", snapout);
+	ok = fwrite(&h, sizeof h, 1, fp) == 1 &&
+	     fwrite(keysig, sizeof *keysig, nitems, fp) == nitems &&
+	     fwrite(off, sizeof *off, nitems, fp) == nitems &&
+	     fwrite(keylen, sizeof *keylen, nitems, fp) == nitems &&
+	     fwrite(w, sizeof *w, nitems, fp) == nitems &&
+	     fwrite(fields, sizeof *fields, 4 * nitems, fp) == 4 * nitems &&
+	     snappad(fp, 7 * nitems * sizeof *off);
+	for (i = 0; ok && i < nitems; i++)
+		ok = fwrite(searchkey(&items[i]), 1, keylen[i] + 1, fp) == keylen[i] + 1;
+	ok = ok && snappad(fp, h.keyslen);
+	for (i = 0; ok && i < nitems; i++) {
+		e = itemext(&items[i]);
+		f[0] = keyapart() ? items[i].text : NULL;
+		f[1] = e->value;
+		f[2] = e->id;
+		f[3] = e->icon;
+		for (j = 0; ok && j < 4; j++)
+			if (f[j])
+				ok = fwrite(f[j], 1, strlen(f[j]) + 1, fp) == strlen(f[j]) + 1;
+	}
+	ok = ok && snappad(fp, h.strslen);
+	if (ok && h.tri)
+		ok = fwrite(tri.cnt, sizeof *tri.cnt, NTRI, fp) == NTRI &&
+		     fwrite(tri.off, sizeof *tri.off, NTRI + 1, fp) == NTRI + 1 &&
+		     fwrite(tri.post, 1, h.postlen, fp) == h.postlen;
+	if (fclose(fp) || !ok || rename(tmp, snapout)) {
+		unlink(tmp);
+		die("cannot write snapshot %s:", snapout);
+	}
+	free(off);
+	free(w);
+	free(fields);
+}
+
+/* map the items saved by snapsave() from snapfile; keys, fields and the
+ * trigram index stay in the mapping, only the per item arrays that change
+ * are copied */
+static void
+snapload(void)
+{
+	const struct snaphdr *h;
+	const uint32_t *off, *len, *fields;
+	uint64_t head, size, end, k;
+	struct itemext *e;
+	struct stat st;
+	char *m, *strs;
+	size_t i, j;
+	int fd;
+
+	if ((fd = open(snapfile, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+		die("cannot open snapshot %s:", snapfile);
+	size = st.st_size;
+	m = size < sizeof *h ? MAP_FAILED :
+	    mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		die("%s: not a dmenu snapshot", snapfile);
+	h = (const struct snaphdr *)m;
+	if (memcmp(h->magic, "dmsnap1\n", sizeof h->magic))
+		die("%s: not a dmenu snapshot", snapfile);
+	if (h->fold != fold)
+		die("%s: saved %s -i", snapfile, h->fold ? "with" : "without");
+	if (h->fields != fieldhash())
+		die("%s: saved with other -d, -nth or -with-nth", snapfile);
+	/* every length is checked against the file size before it is summed */
+	if (h->n >= UINT32_MAX || h->n > size / 36 || h->keyslen > size ||
+	    h->strslen > size || h->postlen > size)
+		die("%s: corrupt snapshot", snapfile);
+	head = sizeof *h + h->n * sizeof *keysig + SNAPALIGN(h->n * 7 * sizeof *keyoff);
+	end = head + SNAPALIGN(h->keyslen) + SNAPALIGN(h->strslen);
+	if (h->tri)
+		end += NTRI * sizeof *tri.cnt + (NTRI + 1) * sizeof *tri.off + h->postlen;
+	if (end != size || !h->keyslen != !h->n ||
+	    (h->keyslen && m[head + h->keyslen - 1]) ||
+	    (h->strslen && m[head + SNAPALIGN(h->keyslen) + h->strslen - 1]))
+		die("%s: corrupt snapshot", snapfile);
+	off = (const uint32_t *)(m + sizeof *h + h->n * sizeof *keysig);
+	len = off + h->n;
+	itemws = len + h->n;
+	fields = itemws + h->n;
+	strs = m + head + SNAPALIGN(h->keyslen);
+	for (i = 0; i < h->n; i++) {
+		if ((uint64_t)off[i] + len[i] >= h->keyslen)
+			die("%s: corrupt snapshot", snapfile);
+		for (j = 0; j < 4; j++)
+			if (fields[4 * i + j] > h->strslen ||
+			    (j == 0 && keyapart() != !!fields[4 * i]))
+				die("%s: corrupt snapshot", snapfile);
+	}
+
+	snap = m;
+	snaplen = size;
+	nitems = h->n;
+	itemsize = nitems + 1;
+	items = ecalloc(itemsize, sizeof *items);
+	keyoff = ecalloc(itemsize, sizeof *keyoff);
+	keylen = ecalloc(itemsize, sizeof *keylen);
+	keysig = ecalloc(itemsize, sizeof *keysig);
+	tiers = ecalloc(itemsize, sizeof *tiers);
+	memcpy(keysig, m + sizeof *h, nitems * sizeof *keysig);
+	memcpy(keyoff, off, nitems * sizeof *keyoff);
+	memcpy(keylen, len, nitems * sizeof *keylen);
+	memset(tiers, -1, itemsize * sizeof *tiers);
+	keys = m + head;
+	keyslen = keyssize = h->keyslen;
+	for (i = 0; i < nitems; i++) {
+		k = 4 * i;
+		items[i].text = fields[k] ? strs + fields[k] - 1 : NULL;
+		if (!fields[k + 1] && !fields[k + 2] && !fields[k + 3])
+			continue;
+		e = extnew(&items[i]);
+		e->value = fields[k + 1] ? strs + fields[k + 1] - 1 : NULL;
+		e->id = fields[k + 2] ? strs + fields[k + 2] - 1 : NULL;
+		e->icon = fields[k + 3] ? strs + fields[k + 3] - 1 : NULL;
+	}
+	/* widths measured with other fonts are measured again as needed */
+	if (h->font != fonthash())
+		itemws = NULL;
+
+	if (h->tri && trigrams) {
+		tri.n = nitems;
+		tri.cnt = (uint32_t *)(strs + SNAPALIGN(h->strslen));
+		tri.off = (uint64_t *)(tri.cnt + NTRI);
+		tri.post = (unsigned char *)(tri.off + NTRI + 1);
+		if (!trioffok(h->postlen))
+			die("%s: corrupt snapshot", snapfile);
+		tricand = ecalloc(nitems + 1, sizeof *tricand);
+	} else if (trigrams) {
+		triindex();
+	}
+	lines = MIN(lines, nitems);
+}
+
+static int
+tricmp(const void *a, const void *b)
+{
+	uint32_t x = tri.cnt[*(const unsigned int *)a];
+	uint32_t y = tri.cnt[*(const unsigned int *)b];
+
+	return (x > y) - (x < y);
+}
+
+/* intersect the posting lists of every trigram in the tokens into tricand;
+ * returns 0 if no token is long enough to narrow the search */
+static int
+trifilter(void)
+{
+	static unsigned int keys[sizeof text];
+	const unsigned char *p, *end;
+	size_t nkeys = 0, i, j, n;
+	uint32_t d, v;
+	int t, shift;
+	char *s;
+
+	if (!tri.off || streaming())
+		return 0;
+	for (t = 0; t < tokc; t++)
+		for (s = tokv[t]; s[0] && s[1] && s[2]; s++)
+			keys[nkeys++] = trikey(s);
+	if (!nkeys)
+		return 0;
+	/* start from the rarest trigram so the candidate set is small early */
+	qsort(keys, nkeys, sizeof *keys, tricmp);
+	for (ntricand = 0, i = 0; i < nkeys; i++) {
+		if (i && keys[i] == keys[i - 1])
+			continue;
+		p = tri.post + tri.off[keys[i]];
+		end = tri.post + tri.off[keys[i] + 1];
+		for (n = 0, j = 0, v = 0; p < end && (i == 0 || j < ntricand);) {
+			for (d = 0, shift = 0; p < end && *p & 0x80 && shift < 28; shift += 7)
+				d |= (uint32_t)(*p++ & 0x7f) << shift;
+			/* an index loaded from a file may be damaged; items
+			 * ascend, and every one of them is in range */
+			if (p == end || *p & 0x80 ||
+			    !(d |= (uint32_t)*p++ << shift) || d > tri.n - v) {
+				fprintf(stderr, "warning: damaged trigram index, not used\n");
+				tri.off = NULL;
+				return 0;
+			}
+			v += d; /* item index + 1 */
+			if (i == 0) {
+				tricand[n++] = v - 1;
+				continue;
+			}
+			while (j < ntricand && tricand[j] < v - 1)
+				j++;
+			if (j < ntricand && tricand[j] == v - 1)
+				tricand[n++] = tricand[j++];
+		}
+		if (!(ntricand = n))
+			break;
+	}
+	return 1;
+}
+
+/* copy the longest literal that every match of the regex pat contains
+ * into lit; groups may not match as a whole, so only top level counts */
+static void
+regexlit(const char *pat, char *lit)
+{
+	char run[sizeof text];
+	size_t n = 0, best = 0;
+	int c, depth = 0, opt, rep;
+
+	lit[0] = '\0';
+	while (*pat) {
+		c = -1;
+		switch (*pat) {
+		case '|':
+			if (!depth) {
+				lit[0] = '\0';
+				return;
+			}
+			pat++;
+			break;
+		case '(':
+			depth++;
+			pat++;
+			break;
+		case ')':
+			depth -= depth > 0;
+			pat++;
+			break;
+		case '[':
+			pat += 1 + (pat[1] == '^');
+			pat += *pat == ']';
+			while (*pat && *pat != ']') {
+				/* [:class:], [=equiv=] and [.coll.] may hold a ] */
+				if (*pat == '[' && pat[1] && strchr(":=.", pat[1])) {
+					for (c = pat[1], pat += 2; *pat &&
+					     !(pat[0] == c && pat[1] == ']'); pat++)
+						;
+					pat += *pat ? 2 : 0;
+				} else {
+					pat++;
+				}
+			}
+			c = -1;
+			pat += !!*pat;
+			break;
+		case '\\':
+			/* other escapes, like the GNU \< and \>, match no text */
+			if (pat[1] && strchr(".[]()*+?{}|^$\\", pat[1]))
+				c = (unsigned char)pat[1];
+			pat += 1 + !!pat[1];
+			break;
+		case '.': case '^': case '$':
+		case '*': case '+': case '?': case '{':
+			pat++;
+			break;
+		default:
+			c = (unsigned char)*pat++;
+		}
+		/* a quantified atom may be absent, and a repeated one ends the run */
+		for (opt = rep = 0; *pat && strchr("*+?{", *pat); pat++) {
+			opt |= *pat != '+';
+			rep = 1;
+			if (*pat == '{')
+				while (pat[1] && *pat != '}')
+					pat++;
+		}
+		if (c >= 0 && !depth && !opt)
+			run[n++] = c;
+		if (c < 0 || depth || rep) {
+			if (n > best)
+				memcpy(lit, run, (best = n));
+			lit[best] = '\0';
+			n = 0;
+		}
+	}
+	if (n > best)
+		memcpy(lit, run, (best = n));
+	lit[best] = '\0';
+}
+
+static int
+matchitem(struct item *item)
+{
+	static char *fields;
+	static size_t fieldsize;
+	regmatch_t m;
+	const char *key;
+	size_t j = item - items;
+	int i;
+
+	if (tiers[j] == REMOVED)
+		return -1;
+	if (gencmd)
+		return 0; /* the generator did the filtering */
+	/* a key missing a byte of the tokens or shorter than one cannot
+	 * contain them all; this rejects most items without a scan */
+	if ((keysig[j] & toksig) != toksig || keylen[j] < tokmax)
+		return -1;
+	if (reok) {
+		/* the single token is a literal every match contains */
+		if (tokc && !strstr(searchkey(item), tokv[0]))
+			return -1;
+		/* the pattern is not folded, so it runs on the text, or on
+		 * the fields of the text with -nth */
+		key = !nnth ? itemtext(item) : !fold ? searchkey(item) :
+		      pickfields(itemtext(item), nth, nnth, &fields, &fieldsize);
+		if (regexec(&re, key, 1, &m, 0))
+			return -1;
+		return m.rm_so ? 2 : key[m.rm_eo] ? 1 : 0;
+	}
+	key = searchkey(item);
+	for (i = 0; i < tokc; i++)
+		if (!strstr(key, tokv[i]))
+			return -1; /* not all tokens match */
+	if (!tokc || !strncmp(query, key, textsize))
+		return 0;
+	else if (!strncmp(tokv[0], key, toklen))
+		return 1;
+	return 2;
+}
+
+static void
+mcachefree(struct mcache *c)
+{
+	mcachebytes -= c->n * sizeof *c->v + strlen(c->text) + 1;
+	free(c->text);
+	free(c->v);
+	memset(c, 0, sizeof *c);
+}
+
+/* forget all match lists; called whenever the items change */
+static void
+mcacheclear(void)
+{
+	size_t i;
+
+	for (i = 0; i < MCACHE && mcache[i].text; i++)
+		mcachefree(&mcache[i]);
+}
+
+/* find the match list of the input text, or else of the longest input it
+ * extends; token matches of the longer input are a subset of those */
+static struct mcache *
+mcachefind(const char *text)
+{
+	struct mcache c;
+	size_t i, best = MCACHE, len, bestlen = 0;
+
+	for (i = 0; i < MCACHE && mcache[i].text; i++) {
+		len = strlen(mcache[i].text);
+		if (!strcmp(mcache[i].text, text)) {
+			best = i;
+			break;
+		} else if (!regexmode && !strncmp(mcache[i].text, text, len) &&
+		           (best == MCACHE || len > bestlen)) {
+			best = i;
+			bestlen = len;
+		}
+	}
+	if (best == MCACHE)
+		return NULL;
+	c = mcache[best];
+	memmove(&mcache[1], &mcache[0], best * sizeof *mcache);
+	mcache[0] = c;
+	return &mcache[0];
+}
+
+static void
+mcachestore(const char *text, const uint32_t *v, const size_t *te)
+{
+	struct mcache *c;
+	size_t bytes = te[2] * sizeof *v + strlen(text) + 1;
+
+	if (bytes > MCACHEBYTES)
+		return;
+	while (mcache[MCACHE - 1].text || mcachebytes + bytes > MCACHEBYTES) {
+		for (c = &mcache[MCACHE - 1]; !c->text; c--)
+			;
+		mcachefree(c);
+	}
+	memmove(&mcache[1], &mcache[0], (MCACHE - 1) * sizeof *mcache);
+	c = &mcache[0];
+	if (!(c->text = strdup(text)))
+		die("cannot strdup %zu bytes:", strlen(text) + 1);
+	c->v = ecalloc(MAX(te[2], 1), sizeof *c->v);
+	memcpy(c->v, v, te[2] * sizeof *c->v);
+	memcpy(c->tierend, te, sizeof c->tierend);
+	c->n = te[2];
+	mcachebytes += bytes;
+}
+
+/* merge the tiers of c, each in item order, into the item ordered cand */
+static size_t
+narrow(const struct mcache *c, uint32_t *cand)
+{
+	size_t i[3], n = 0;
+	int t, min;
+
+	i[0] = 0;
+	i[1] = c->tierend[0];
+	i[2] = c->tierend[1];
+	for (;;) {
+		for (min = -1, t = 0; t < 3; t++)
+			if (i[t] < c->tierend[t] &&
+			    (min < 0 || c->v[i[t]] < c->v[i[min]]))
+				min = t;
+		if (min < 0)
+			return n;
+		cand[n++] = c->v[i[min]++];
+	}
+}
+
+static int
+stale(unsigned long gen)
+{
+	int r;
+
+	pthread_mutex_lock(&matchlock);
+	r = gen != mgen || mquit;
+	pthread_mutex_unlock(&matchlock);
+	return r;
+}
+
+/* order each tier of v by source, stably; cached lists stay in item
+ * order, which narrow() relies on */
+static void
+srcsort(uint32_t *v, const size_t *te)
+{
+	static uint32_t *tmp;
+	static size_t tmpsize;
+	size_t i, start, pos[SOURCES + 2];
+	int t, k;
+
+	if (!srcorder || nsrcs < 1 || !te[2])
+		return;
+	if (tmpsize < te[2]) {
+		free(tmp);
+		tmp = ecalloc((tmpsize = itemsize), sizeof *tmp);
+	}
+	for (t = 0, start = 0; t < 3; start = te[t++]) {
+		memset(pos, 0, sizeof pos);
+		for (i = start; i < te[t]; i++)
+			pos[items[v[i]].src + 1]++;
+		for (k = 1; k <= nsrcs; k++)
+			pos[k] += pos[k - 1];
+		for (i = start; i < te[t]; i++)
+			tmp[pos[items[v[i]].src]++] = v[i];
+		memcpy(v + start, tmp, (te[t] - start) * sizeof *v);
+	}
+}
+
+/* match the items against text into v, with the tier ends in te; with a
+ * nonzero gen, gives up and returns 0 once the input moves past gen */
+static int
+filter(const char *text, uint32_t *v, size_t *te, unsigned long gen)
+{
+	static char buf[sizeof query], lit[sizeof text], flit[sizeof query];
+	static uint32_t *tierv[2];
+	static uint32_t *candv;
+	static size_t tiervsize, candvsize;
+
+	char *s, *sp;
+	const uint32_t *cand = NULL;
+	size_t i, j, ncand = 0, n[3] = { 0 };
+	int t;
+	struct mcache *c;
+
+	if (fold)
+		foldstr(text, query, sizeof query);
+	else
+		strcpy(query, text);
+	strcpy(buf, query);
+	/* separate input text into tokens to be matched individually; this
+	 * runs on the worker while the UI thread may index the icon theme */
+	for (tokc = 0, s = strtok_r(buf, " ", &sp); s;
+	     tokv[tokc - 1] = s, s = strtok_r(NULL, " ", &sp))
+		if (++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
+			die("cannot realloc %zu bytes:", tokn * sizeof *tokv);
+	toklen = tokc ? strlen(tokv[0]) : 0;
+	if (regexmode) {
+		/* partial patterns that do not compile yet match literally */
+		if (reok)
+			regfree(&re);
+		reok = text[0] && !regcomp(&re, text, REG_EXTENDED |
+		                           (fold ? REG_ICASE : 0));
+		if (reok) {
+			regexlit(text, lit);
+			s = lit;
+			if (fold)
+				foldstr(lit, (s = flit), sizeof flit);
+			if ((tokc = !!s[0]) && !tokn &&
+			    !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
+				die("cannot realloc %zu bytes:", tokn * sizeof *tokv);
+			if (tokc)
+				tokv[0] = s;
+		}
+	}
+	for (toksig = 0, tokmax = 0, t = 0; t < tokc; t++) {
+		i = strlen(tokv[t]);
+		toksig |= sign(tokv[t], i);
+		tokmax = MAX(tokmax, i);
+	}
+
+	if (tiervsize < nitems) {
+		free(tierv[0]);
+		free(tierv[1]);
+		tierv[0] = ecalloc((tiervsize = itemsize), sizeof *tierv[0]);
+		tierv[1] = ecalloc(tiervsize, sizeof *tierv[1]);
+	}
+	textsize = strlen(query) + 1;
+	/* cached lists go stale as streamed items change, and item tiers are
+	 * only kept for them; so the cache is only used once items are final */
+	if (!streaming() && (c = mcachefind(text))) {
+		if (!strcmp(c->text, text)) {
+			memcpy(v, c->v, c->n * sizeof *v);
+			memcpy(te, c->tierend, sizeof c->tierend);
+			srcsort(v, te);
+			return 1;
+		}
+		if (candvsize < nitems) {
+			free(candv);
+			candv = ecalloc((candvsize = itemsize), sizeof *candv);
+		}
+		ncand = narrow(c, candv);
+		cand = candv;
+	} else if (trifilter()) {
+		ncand = ntricand;
+		cand = tricand;
+	}
+	/* exact matches go first, then prefixes, then substrings */
+	for (i = 0; cand ? i < ncand : i < nitems; i++) {
+		if (gen && !(i & 4095) && stale(gen))
+			return 0;
+		j = cand ? cand[i] : i;
+		if (tiers[j] != REMOVED && (tiers[j] = t = matchitem(&items[j])) >= 0)
+			(t ? tierv[t - 1] : v)[n[t]++] = j;
+	}
+	memcpy(v + n[0], tierv[0], n[1] * sizeof *v);
+	memcpy(v + n[0] + n[1], tierv[1], n[2] * sizeof *v);
+	te[0] = n[0];
+	te[1] = n[0] + n[1];
+	te[2] = n[0] + n[1] + n[2];
+	if (!streaming())
+		mcachestore(text, v, te);
+	srcsort(v, te);
+	return 1;
+}
+
+/* matches are computed here while the worker runs; only the newest input
+ * is matched, and a scan of an older one is abandoned */
+static void *
+matchworker(void *arg)
+{
+	char input[sizeof text];
+	unsigned long gen = 0;
+	size_t te[3];
+	int done;
+
+	pthread_mutex_lock(&matchlock);
+	for (;;) {
+		while (gen == mgen && !mquit)
+			pthread_cond_wait(&matchcond, &matchlock);
+		if (mquit)
+			break;
+		gen = mgen;
+		strcpy(input, mtext);
+		pthread_mutex_unlock(&matchlock);
+		done = filter(input, mv, te, gen);
+		pthread_mutex_lock(&matchlock);
+		if (done && gen == mgen) {
+			memcpy(mtierend, te, sizeof te);
+			mready = 1;
+			pthread_cond_broadcast(&matchcond);
+			write(mpipe[1], "", 1);
+		}
+	}
+	pthread_mutex_unlock(&matchlock);
+	return NULL;
+}
+
+/* move matching to the worker once the items are final */
+static void
+matchstart(void)
+{
+	if (matcher || streaming() || gencmd || pipe(mpipe) < 0)
+		return;
+	if (matchvsize < itemsize) {
+		matchvsize = itemsize;
+		if (!(matchv = realloc(matchv, matchvsize * sizeof *matchv)))
+			die("cannot realloc %zu bytes:", matchvsize * sizeof *matchv);
+	}
+	fcntl(mpipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(mpipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(mpipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(mpipe[1], F_SETFD, FD_CLOEXEC);
+	mv = ecalloc(MAX(matchvsize, 1), sizeof *mv);
+	if (!(matcher = !pthread_create(&matchthread, NULL, matchworker, NULL))) {
+		close(mpipe[0]);
+		close(mpipe[1]);
+	}
+}
+
+/* take the worker's result, waiting for it if block */
+static void
+matchdone(int block)
+{
+	char buf[64];
+	uint32_t *v;
+
+	while (read(mpipe[0], buf, sizeof buf) > 0)
+		;
+	if (!mpending)
+		return;
+	pthread_mutex_lock(&matchlock);
+	while (block && !mready)
+		pthread_cond_wait(&matchcond, &matchlock);
+	if (!mready) {
+		pthread_mutex_unlock(&matchlock);
+		return;
+	}
+	v = matchv;
+	matchv = mv;
+	mv = v;
+	memcpy(tierend, mtierend, sizeof tierend);
+	mready = mpending = 0;
+	pthread_mutex_unlock(&matchlock);
+	nmatches = tierend[2];
+	sel = 0;
+	setcurr(0);
+}
+
+static void
+match(void)
+{
+	if (gencmd && (!genhave || strcmp(text, genquery))) {
+		clock_gettime(CLOCK_MONOTONIC, &genat);
+		genpending = 1;
+	}
+	if (matcher) {
+		/* the current matches stay up until the new ones are in */
+		pthread_mutex_lock(&matchlock);
+		strcpy(mtext, text);
+		mgen++;
+		mready = 0;
+		pthread_cond_broadcast(&matchcond);
+		pthread_mutex_unlock(&matchlock);
+		mpending = 1;
+		return;
+	}
+	if (matchvsize < nitems) {
+		free(matchv);
+		matchv = ecalloc((matchvsize = itemsize), sizeof *matchv);
+	}
+	filter(text, matchv, tierend, 0);
+	nmatches = tierend[2];
+	sel = 0;
+	setcurr(0);
+}
+
+/* take a single item out of the match list, keeping the page in place;
+ * returns the position it had, or -1 */
+static size_t
+unlinkmatch(struct item *item)
+{
+	size_t i, t;
+	int tier = tiers[item - items];
+
+	if (tier < 0)
+		return -1;
+	for (i = tier ? tierend[tier - 1] : 0; matchat(i) != item; i++)
+		;
+	memmove(matchv + i, matchv + i + 1, (--nmatches - i) * sizeof *matchv);
+	for (t = tier; t < LENGTH(tierend); t++)
+		tierend[t]--;
+	if (sel > i || (sel == i && sel == nmatches && sel > 0))
+		sel--;
+	if (curr > i || (curr == i && curr == nmatches && curr > 0))
+		curr--;
+	tiers[item - items] = -1;
+	return i;
+}
+
+/* put a single item at the end of its tier in the match list, or of its
+ * source in the tier with -srcorder source; returns its position, or -1 */
+static size_t
+linkmatch(struct item *item, int tier)
+{
+	size_t i, t, lo, mid;
+
+	if ((tiers[item - items] = tier) < 0)
+		return -1;
+	if (matchvsize < nmatches + 1) {
+		matchvsize = MAX(itemsize, 2 * matchvsize);
+		if (!(matchv = realloc(matchv, matchvsize * sizeof *matchv)))
+			die("cannot realloc %zu bytes:", matchvsize * sizeof *matchv);
+	}
+	i = tierend[tier];
+	/* after the last match of the same or an earlier source */
+	for (lo = tier ? tierend[tier - 1] : 0; srcorder && nsrcs && lo < i;) {
+		mid = lo + (i - lo) / 2;
+		if (matchat(mid)->src <= item->src)
+			lo = mid + 1;
+		else
+			i = mid;
+	}
+	memmove(matchv + i + 1, matchv + i, (nmatches - i) * sizeof *matchv);
+	matchv[i] = item - items;
+	for (t = tier; t < LENGTH(tierend); t++)
+		tierend[t]++;
+	if (nmatches++ && sel >= i)
+		sel++;
+	if (nmatches > 1 && curr >= i)
+		curr++;
+	return i;
+}
+
+static void
+insert(const char *str, ssize_t n)
+{
+	if (strlen(text) + n > sizeof text - 1)
+		return;
+	/* move existing text out of the way, insert new text, and update cursor */
+	memmove(&text[cursor + n], &text[cursor], sizeof text - cursor - MAX(n, 0));
+	if (n > 0)
+		memcpy(&text[cursor], str, n);
+	cursor += n;
+	match();
+}
+
+static size_t
+nextrune(int inc)
+{
+	ssize_t n;
+
+	/* return location of next utf8 rune in the given direction (+1 or -1) */
+	for (n = cursor + inc; n + inc >= 0 && (text[n] & 0xc0) == 0x80; n += inc)
+		;
+	return n;
+}
+
+static void
+movewordedge(int dir)
+{
+	if (dir < 0) { /* move cursor to the start of the word*/
+		while (cursor > 0 && strchr(worddelimiters, text[nextrune(-1)]))
+			cursor = nextrune(-1);
+		while (cursor > 0 && !strchr(worddelimiters, text[nextrune(-1)]))
+			cursor = nextrune(-1);
+	} else { /* move cursor to the end of the word */
+		while (text[cursor] && strchr(worddelimiters, text[cursor]))
+			cursor = nextrune(+1);
+		while (text[cursor] && !strchr(worddelimiters, text[cursor]))
+			cursor = nextrune(+1);
+	}
+}
+
+static void
+putfield(const char *s)
+{
+	uint32_t n = s ? strlen(s) : 0;
+	unsigned char len[4] = { n & 0xff, n >> 8 & 0xff, n >> 16 & 0xff, n >> 24 };
+
+	fwrite(len, 1, sizeof len, stdout);
+	fwrite(s, 1, n, stdout);
+}
+
+/* print item, or the input text if NULL, in the framing it was read in */
+static void
+printitem(struct item *item)
+{
+	const struct itemext *e = item ? itemext(item) : &noext;
+	const char *s = !item ? text : e->value ? e->value : itemtext(item);
+
+	switch (informat) {
+	case InLines:
+		puts(s);
+		break;
+	case InNul:
+		fputs(s, stdout);
+		putchar('\0');
+		break;
+	case InRecord:
+		putfield(item ? itemtext(item) : text);
+		putfield(e->value);
+		putfield(e->id);
+		putfield(e->icon);
+		break;
+	}
+}
+
+static void
+keypress(XKeyEvent *ev)
+{
+	char buf[32];
+	int len;
+	KeySym ksym;
+	Status status;
+	int i, offscreen = 0;
+	size_t tmpsel;
+	struct item *item;
+
+	len = XmbLookupString(xic, ev, buf, sizeof buf, &ksym, &status);
+	switch (status) {
+	default: /* XLookupNone, XBufferOverflow */
+		return;
+	case XLookupChars:
+		goto insert;
+	case XLookupKeySym:
+	case XLookupBoth:
+		break;
+	}
+
+	if (ev->state & ControlMask) {
 		switch(ksym) {
 		case XK_a: ksym = XK_Home;      break;
 		case XK_b: ksym = XK_Left;      break;
@@ -587,412 +2776,1423 @@ keypress(XKeyEvent *ev)
 		}
 	}
 
-	switch(ksym) {
-	default:
-insert:
-		if (!iscntrl((unsigned char)*buf))
-			insert(buf, len);
-		break;
-	case XK_Delete:
-	case XK_KP_Delete:
-		if (text[cursor] == '\0')
-			return;
-		cursor = nextrune(+1);
-		/* fallthrough */
-	case XK_BackSpace:
-		if (cursor == 0)
-			return;
-		insert(NULL, nextrune(-1) - cursor);
-		break;
-	case XK_End:
-	case XK_KP_End:
-		if (text[cursor] != '\0') {
-			cursor = strlen(text);
-			break;
+	switch(ksym) {
+	default:
+insert:
+		if (!iscntrl((unsigned char)*buf))
+			insert(buf, len);
+		break;
+	case XK_Delete:
+	case XK_KP_Delete:
+		if (text[cursor] == '\0')
+			return;
+		cursor = nextrune(+1);
+		/* fallthrough */
+	case XK_BackSpace:
+		if (cursor == 0)
+			return;
+		insert(NULL, nextrune(-1) - cursor);
+		break;
+	case XK_End:
+	case XK_KP_End:
+		if (text[cursor] != '\0') {
+			cursor = strlen(text);
+			break;
+		}
+		if (!nmatches)
+			break;
+		if (lines > 0) {
+			/* the grid clamps to its last full page */
+			setcurr(nmatches - 1);
+		} else if (next < nmatches) {
+			/* jump to end of list and position items in reverse */
+			setcurr(nmatches - 1);
+			setcurr(prev);
+			while (next < nmatches && curr + 1 < nmatches)
+				setcurr(curr + 1);
+		}
+		sel = nmatches - 1;
+		break;
+	case XK_Escape:
+		cleanup();
+		exit(1);
+	case XK_Home:
+	case XK_KP_Home:
+		if (sel == 0) {
+			cursor = 0;
+			break;
+		}
+		sel = 0;
+		setcurr(0);
+		break;
+	case XK_Left:
+	case XK_KP_Left:
+		if ((columns > 1 || lines == 0) &&
+			nmatches && sel > 0 && --sel + 1 == curr) {
+			setcurr(prev);
+            break;
+		}
+		if (cursor > 0 && (!nmatches || sel == 0 || lines > 0)) {
+			cursor = nextrune(-1);
+			break;
+		}
+		break;
+	case XK_Up:
+	case XK_KP_Up:
+		if (!nmatches)
+			return;
+		tmpsel = sel;
+		for (i = 0; i < columns; i++) {
+			if (tmpsel == 0) {
+				if (offscreen)
+					break;
+				return;
+			}
+			if (tmpsel == curr)
+				offscreen = 1;
+			tmpsel--;
+		}
+		sel = tmpsel;
+		if (offscreen) {
+			setcurr(prev);
+		}
+		break;
+	case XK_Next:
+	case XK_KP_Next:
+		if (next >= nmatches)
+			return;
+		sel = next;
+		setcurr(next);
+		break;
+	case XK_Prior:
+	case XK_KP_Prior:
+		if (!nmatches)
+			return;
+		sel = prev;
+		setcurr(prev);
+		break;
+	case XK_Return:
+	case XK_KP_Enter:
+		if (matcher)
+			matchdone(1); /* select from what was typed */
+		item = selected();
+		printitem(ev->state & ShiftMask ? NULL : item);
+		if (!(ev->state & ControlMask)) {
+			cleanup();
+			exit(0);
+		}
+		if (item)
+			item->out = 1;
+		break;
+	case XK_Right:
+	case XK_KP_Right:
+		if ((columns > 1 || lines == 0) &&
+			nmatches && sel + 1 < nmatches && ++sel == next) {
+			setcurr(next);
+			break;
+		}
+		if (text[cursor] != '\0') {
+			cursor = nextrune(+1);
+			break;
+		}
+		break;
+	case XK_Down:
+	case XK_KP_Down:
+		if (!nmatches)
+			return;
+		tmpsel = sel;
+		for (i = 0; i < columns; i++) {
+			if (tmpsel + 1 >= nmatches) {
+				if (offscreen)
+					break;
+				return;
+			}
+			if (++tmpsel == next)
+				offscreen = 1;
+		}
+		sel = tmpsel;
+		if (offscreen) {
+			setcurr(next);
+		}
+		break;
+	case XK_Tab:
+		if (!nmatches)
+			return;
+		strncpy(text, itemtext(selected()), sizeof text - 1);
+		text[sizeof text - 1] = '\0';
+		cursor = strlen(text);
+		match();
+		break;
+	}
+
+draw:
+	drawmenu();
+}
+
+static void
+buttonpress(XEvent *e)
+{
+	struct item *item;
+	XButtonPressedEvent *ev = &e->xbutton;
+	int x = 0, y = -icon_size, h = bh, w;
+	size_t i;
+
+	if (ev->window != win)
+		return;
+
+	/* right-click: exit */
+	if (ev->button == Button3)
+		exit(1);
+
+	if (prompt && *prompt)
+		x += promptw;
+
+	/* input field */
+	w = (lines > 0 || !nmatches) ? mw - x : inputw;
+
+	/* left-click on input: clear input,
+	 * NOTE: if there is no left-arrow the space for < is reserved so
+	 *		 add that to the input width */
+	if (ev->button == Button1 &&
+		((lines <= 0 && ev->x >= 0 && ev->x <= x + w +
+		  ((!nmatches || curr == 0) ? TEXTW("<") : 0)) ||
+		 (lines > 0 && ev->y >= y && ev->y <= y + h))) {
+		insert(NULL, -cursor);
+		drawmenu();
+		return;
+	}
+	/* middle-mouse click: paste selection */
+	if (ev->button == Button2) {
+		XConvertSelection(dpy, (ev->state & ShiftMask) ? clip : XA_PRIMARY,
+						  utf8, utf8, win, CurrentTime);
+		drawmenu();
+		return;
+	}
+	/* scroll the grid smoothly, one row per step; run() animates it */
+	if ((ev->button == Button4 || ev->button == Button5) && lines > 0) {
+		scrollto += ev->button == Button4 ? -bh : bh;
+		scrollto = MAX(0, MIN(scrollto, maxscroll()));
+		return;
+	}
+	/* scroll up */
+	if (ev->button == Button4 && nmatches) {
+		sel = prev;
+		setcurr(prev);
+		drawmenu();
+		return;
+	}
+	/* scroll down */
+	if (ev->button == Button5 && next < nmatches) {
+		sel = next;
+		setcurr(next);
+		drawmenu();
+		return;
+	}
+	if (ev->button != Button1)
+		return;
+	if (ev->state & ~ControlMask)
+		return;
+	if (lines > 0) {
+		/* vertical list: (ctrl)left-click on item */
+		if ((i = gridcell(ev->x, ev->y)) < nmatches) {
+			item = selected();
+			printitem(item);
+			if (!(ev->state & ControlMask))
+				exit(0);
+			sel = i;
+			matchat(sel)->out = 1;
+			drawmenu();
+		}
+	} else if (nmatches) {
+		/* left-click on left arrow */
+		x += inputw;
+		w = TEXTW("<");
+		if (curr > 0) {
+			if (ev->x >= x && ev->x <= x + w) {
+				sel = prev;
+				setcurr(prev);
+				drawmenu();
+				return;
+			}
+		}
+		/* horizontal list: (ctrl)left-click on item */
+		for (i = curr; i < next; i++) {
+			x += w;
+			w = MIN(TEXTW(itemtext(matchat(i))), mw - x - TEXTW(">"));
+			if (ev->x >= x && ev->x <= x + w) {
+				item = selected();
+				printitem(item);
+				if (!(ev->state & ControlMask))
+					exit(0);
+				sel = i;
+				matchat(sel)->out = 1;
+				drawmenu();
+				return;
+			}
+		}
+		/* left-click on right arrow */
+		w = TEXTW(">");
+		x = mw - w;
+		if (next < nmatches && ev->x >= x && ev->x <= x + w) {
+			sel = next;
+			setcurr(next);
+			drawmenu();
+			return;
+		}
+	}
+}
+
+static void
+mousemove(XEvent *e)
+{
+	XPointerMovedEvent *ev = &e->xmotion;
+	int x = 0, w;
+	size_t i;
+
+	if (lines > 0) {
+		/* the cell under the pointer is computed, not searched for */
+		if ((i = gridcell(ev->x, ev->y)) < nmatches && i != sel) {
+			sel = i;
+			drawmenu();
 		}
-		if (next) {
-			/* jump to end of list and position items in reverse */
-			curr = matchend;
-			calcoffsets();
-			curr = prev;
-			calcoffsets();
-			while (next && (curr = curr->right))
+	} else if (nmatches) {
+		x += inputw + promptw;
+		w = TEXTW("<");
+		for (i = curr; i < next; i++) {
+			x += w;
+			w = MIN(TEXTW(itemtext(matchat(i))), mw - x - TEXTW(">"));
+			if (ev->x >= x && ev->x <= x + w) {
+				sel = i;
 				calcoffsets();
+				drawmenu();
+				return;
+			}
 		}
-		sel = matchend;
-		break;
-	case XK_Escape:
-		cleanup();
-		exit(1);
-	case XK_Home:
-	case XK_KP_Home:
-		if (sel == matches) {
-			cursor = 0;
-			break;
+	}
+}
+
+static void
+paste(void)
+{
+	char *p, *q;
+	int di;
+	unsigned long dl;
+	Atom da;
+
+	/* we have been given the current selection, now insert it into input */
+	if (XGetWindowProperty(dpy, win, utf8, 0, (sizeof text / 4) + 1, False,
+						   utf8, &da, &di, &dl, &dl, (unsigned char **)&p)
+		== Success && p) {
+		insert(p, (q = strchr(p, '\n')) ? q - p : (ssize_t)strlen(p));
+		XFree(p);
+	}
+	drawmenu();
+}
+
+static const char *
+itemid(const struct item *item)
+{
+	return itemext(item)->id;
+}
+
+static const char *
+itemkey(const struct item *item)
+{
+	const char *id = itemext(item)->id;
+
+	return id ? id : itemtext(item);
+}
+
+static const char *
+idat(size_t i)
+{
+	return itemid(&items[i]);
+}
+
+static const char *
+keyat(size_t i)
+{
+	return itemkey(&items[i]);
+}
+
+/* point the slots of t at the new positions of items moved from i to
+ * to[i]; their keys are unchanged, so every slot stays where it is */
+static void
+hmove(struct htab *t, const uint32_t *to)
+{
+	size_t i;
+
+	for (i = 0; i < t->size; i++)
+		if (t->slot[i])
+			t->slot[i] = to[t->slot[i] - 1] + 1;
+}
+
+static struct htab ids = { .key = idat };
+static struct htab uniq = { .key = keyat };
+static int dedup = 0; /* -u option; drop items whose text or id was seen */
+
+static struct item *
+newitem(void)
+{
+	if (nitems + 1 >= itemsize) {
+		itemsize = itemsize ? itemsize * 2 : BUFSIZ / sizeof *items;
+		if (itemsize > UINT32_MAX)
+			die("too many items");
+		if (!(items = realloc(items, itemsize * sizeof *items)) ||
+		    !(keyoff = realloc(keyoff, itemsize * sizeof *keyoff)) ||
+		    !(keylen = realloc(keylen, itemsize * sizeof *keylen)) ||
+		    !(keysig = realloc(keysig, itemsize * sizeof *keysig)) ||
+		    !(tiers = realloc(tiers, itemsize * sizeof *tiers)))
+			die("cannot realloc %zu items:", itemsize);
+		memset(&items[nitems], 0, (itemsize - nitems) * sizeof *items);
+	}
+	keyoff[nitems] = keylen[nitems] = 0;
+	keysig[nitems] = 0;
+	tiers[nitems] = -1;
+	return &items[nitems++];
+}
+
+/* parse a line into item, pointing textp at its text; returns 1 if the
+ * line is a --delete= directive */
+static int
+parseline(struct item *item, char *line, char **textp)
+{
+	static char *shown;
+	static size_t shownsize;
+	char *text, *val, *dupped;
+	int found_opts = 1, del = 0;
+
+	const char *options[] = {"--icon=", "--value=", "--id=", "--delete="};
+
+	text = line;
+	item->text = NULL;
+	item->ext = 0;
+	item->iconslot = 0;
+	item->iconloaded = 0;
+	item->out = 0;
+
+	// TODO: build a sane parse
+	while (strncmp(text, "--", 2) == 0) {
+		for (int i = 0; i < sizeof options / sizeof options[0]; ++i) {
+			if (strncmp(text, options[i], strlen(options[i])) == 0) {
+				val = strtok(found_opts ? text : NULL, " ") +
+					strlen(options[i]);
+				if (!(dupped = strdup(val)))
+					die("cannot strdup %zu bytes:", strlen(val) + 1);
+
+				switch (i) {
+				case 0: extnew(item)->icon  = dupped; break;
+				case 1: extnew(item)->value = dupped; break;
+				case 3: del = 1; /* fallthrough */
+				case 2: extnew(item)->id    = dupped; break;
+				}
+
+				text += strlen(options[i]) + strlen(dupped) + 1;
+				found_opts = 0;
+				break;
+			}
 		}
-		sel = curr = matches;
-		calcoffsets();
-		break;
-	case XK_Left:
-	case XK_KP_Left:
-		if ((columns > 1 || lines == 0) &&
-			sel && sel->left && (sel = sel->left)->right == curr) {
-			curr = prev;
-			calcoffsets();
-            break;
+	}
+
+	if (nwnth) {
+		/* the line is printed, only its fields shown */
+		if (!itemext(item)->value) {
+			if (!(dupped = strdup(text)))
+				die("cannot strdup %zu bytes:", strlen(text) + 1);
+			extnew(item)->value = dupped;
 		}
-		if (cursor > 0 && (!sel || !sel->left || lines > 0)) {
-			cursor = nextrune(-1);
+		text = pickfields(text, wnth, nwnth, &shown, &shownsize);
+	}
+	*textp = text;
+	if (keyapart() && !(item->text = strdup(text)))
+		die("cannot strdup %zu bytes:", strlen(text) + 1);
+	return del;
+}
+
+/* with -u, drop the last read item if its key was seen already */
+static void
+uniqitem(struct item *item)
+{
+	if (!dedup)
+		return;
+	if (hget(&uniq, itemkey(item))) {
+		freeitem(item);
+		memset(item, 0, sizeof *item);
+		nitems--;
+	} else {
+		hput(&uniq, item - items);
+	}
+}
+
+/* slurp stdin into the arena, NUL-terminated */
+static void
+readarena(void)
+{
+	size_t size = 0;
+	ssize_t n;
+
+	for (;;) {
+		if (arenalen + BUFSIZ + 1 > size) {
+			size = MAX(size * 2, arenalen + BUFSIZ + 1);
+			if (!(arena = realloc(arena, size)))
+				die("cannot realloc %zu bytes:", size);
+		}
+		if ((n = read(STDIN_FILENO, arena + arenalen, size - arenalen - 1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("read:");
+		}
+		if (!n)
 			break;
+		arenalen += n;
+	}
+	arena[arenalen] = '\0';
+}
+
+/* set the text of a -0 or -R item, which stays in the arena */
+static void
+addtext(struct item *item, char *s, size_t len)
+{
+	if (keyapart()) {
+		item->text = s;
+		setkey(item, s);
+	} else {
+		keyoff[item - items] = s - arena;
+		keylen[item - items] = len;
+		keysig[item - items] = sign(s, len);
+	}
+}
+
+/* parse -0 or -R input in place; item fields point into the arena.
+ * a -R record is text, value, id and icon, each a 32-bit little-endian
+ * length followed by that many bytes; empty fields other than text are
+ * unset. a field is terminated by overwriting the length that follows it */
+static void
+readrecords(void)
+{
+	char *p, *q, *end, *field[4];
+	struct item *item;
+	struct itemext *e;
+	uint32_t len, textlen = 0;
+	int i;
+
+	readarena();
+	end = arena + arenalen;
+	if (!keyapart()) {
+		/* the texts are the keys, right where they were read */
+		if (arenalen >= UINT32_MAX)
+			die("too much input");
+		keys = arena;
+		keyslen = keyssize = arenalen + 1;
+	}
+	if (informat == InNul) {
+		for (p = arena; p < end; p = q + 1) {
+			if (!(q = memchr(p, '\0', end - p)))
+				q = end;
+			item = newitem();
+			addtext(item, p, q - p);
+			uniqitem(item);
 		}
-		break;
-	case XK_Up:
-	case XK_KP_Up:
-		if (!sel)
-			return;
-		tmpsel = sel;
-		for (i = 0; i < columns; i++) {
-			if (!tmpsel->left || tmpsel->left->right != tmpsel) {
-				if (offscreen)
-					break;
-				return;
-			}
-			if (tmpsel == curr)
-				offscreen = 1;
-			tmpsel = tmpsel->left;
+		return;
+	}
+	for (p = arena; p < end;) {
+		item = newitem();
+		for (i = 0; i < 4; i++) {
+			if (end - p < 4)
+				die("truncated record at byte %zu", (size_t)(p - arena));
+			len = (unsigned char)p[0] | (unsigned char)p[1] << 8 |
+			      (unsigned char)p[2] << 16 | (uint32_t)(unsigned char)p[3] << 24;
+			*p = '\0'; /* terminates the previous field */
+			p += 4;
+			if (len > end - p)
+				die("truncated record at byte %zu", (size_t)(p - 4 - arena));
+			field[i] = (len || !i) ? p : NULL;
+			textlen = i ? textlen : len;
+			p += len;
 		}
-		sel = tmpsel;
-		if (offscreen) {
-			curr = prev;
-			calcoffsets();
+		if (field[1] || field[2] || field[3]) {
+			e = extnew(item);
+			e->value = field[1];
+			e->id = field[2];
+			e->icon = field[3];
 		}
-		break;
-	case XK_Next:
-	case XK_KP_Next:
-		if (!next)
-			return;
-		sel = curr = next;
-		calcoffsets();
-		break;
-	case XK_Prior:
-	case XK_KP_Prior:
-		if (!prev)
+		addtext(item, field[0], textlen);
+		uniqitem(item);
+	}
+}
+
+/* -sort keys; the key of item i is the bytes sortp[i][0 .. sortl[i]) */
+static const unsigned char **sortp;
+static uint32_t *sortl;
+static uint32_t *sortv, *sorttmp;
+static uint16_t *sortc; /* the byte of each position of sortv in a pass */
+/* buckets of sortv waiting for a thread, as offset, length and depth */
+static size_t (*sortq)[3];
+static size_t nsortq, sortqsize, sortbusy;
+static pthread_mutex_t sortlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sortcond = PTHREAD_COND_INITIALIZER;
+
+/* byte d of the key of item i + 1, 0 past its end */
+static unsigned int
+sortbyte(uint32_t i, size_t d)
+{
+	return d < sortl[i] ? sortp[i][d] + 1 : 0;
+}
+
+static int
+sortcmp(uint32_t a, uint32_t b, size_t d)
+{
+	size_t la = sortl[a] - MIN(d, sortl[a]), lb = sortl[b] - MIN(d, sortl[b]);
+	int c;
+
+	if ((c = memcmp(sortp[a] + d, sortp[b] + d, MIN(la, lb))))
+		return c;
+	return (la > lb) - (la < lb);
+}
+
+/* distribute v by byte d of the keys, stably, counting each byte in cnt;
+ * the bytes are fetched once into c, as the keys are scattered in memory */
+static void
+radixpass(uint32_t *v, uint32_t *tmp, uint16_t *c, size_t n, size_t d,
+          size_t *cnt)
+{
+	size_t pos[257], i, b;
+
+	memset(cnt, 0, 257 * sizeof *cnt);
+	for (i = 0; i < n; i++)
+		cnt[c[i] = sortbyte(v[i], d)]++;
+	for (pos[0] = 0, b = 1; b < 257; b++)
+		pos[b] = pos[b - 1] + cnt[b - 1];
+	for (i = 0; i < n; i++)
+		tmp[pos[c[i]]++] = v[i];
+	memcpy(v, tmp, n * sizeof *v);
+}
+
+/* stable MSD radix sort of v by the keys from byte d on; the largest
+ * bucket is looped on, so the recursion stays shallow on common prefixes */
+static void
+radixsort(uint32_t *v, uint32_t *tmp, uint16_t *c, size_t n, size_t d)
+{
+	size_t cnt[257], i, j, b, big, at = 0;
+	uint32_t x;
+
+	for (;;) {
+		if (n < 32) {
+			for (i = 1; i < n; i++) {
+				for (x = v[i], j = i; j && sortcmp(v[j - 1], x, d) > 0; j--)
+					v[j] = v[j - 1];
+				v[j] = x;
+			}
 			return;
-		sel = curr = prev;
-		calcoffsets();
-		break;
-	case XK_Return:
-	case XK_KP_Enter:
-		puts((sel && !(ev->state & ShiftMask)) ?
-			 (sel->value == NULL ? sel->text : sel->value)
-			 : text);
-		if (!(ev->state & ControlMask)) {
-			cleanup();
-			exit(0);
 		}
-		if (sel)
-			sel->out = 1;
-		break;
-	case XK_Right:
-	case XK_KP_Right:
-		if ((columns > 1 || lines == 0) &&
-			sel && sel->right && (sel = sel->right) == next) {
-			curr = next;
-			calcoffsets();
-			break;
-		}
-		if (text[cursor] != '\0') {
-			cursor = nextrune(+1);
-			break;
+		radixpass(v, tmp, c, n, d, cnt);
+		for (big = 1, b = 2; b < 257; b++)
+			if (cnt[b] > cnt[big])
+				big = b;
+		for (i = cnt[0], b = 1; b < 257; i += cnt[b++]) {
+			if (b == big)
+				at = i;
+			else if (cnt[b] > 1)
+				radixsort(v + i, tmp + i, c + i, cnt[b], d + 1);
 		}
-		break;
-	case XK_Down:
-	case XK_KP_Down:
-		if (!sel)
+		if (cnt[big] < 2)
 			return;
-		tmpsel = sel;
-		for (i = 0; i < columns; i++) {
-			if (!tmpsel->right || tmpsel->right->left != tmpsel) {
-				if (offscreen)
-					break;
-				return;
+		v += at;
+		tmp += at;
+		c += at;
+		n = cnt[big];
+		d++;
+	}
+}
+
+/* sort the queued buckets of sortv; big ones are split a byte further
+ * and their buckets queued for the other threads */
+static void *
+sortworker(void *arg)
+{
+	size_t cnt[257], off, n, d, b, i;
+
+	pthread_mutex_lock(&sortlock);
+	for (;;) {
+		while (!nsortq && sortbusy)
+			pthread_cond_wait(&sortcond, &sortlock);
+		if (!nsortq)
+			break;
+		nsortq--;
+		off = sortq[nsortq][0];
+		n = sortq[nsortq][1];
+		d = sortq[nsortq][2];
+		sortbusy++;
+		pthread_mutex_unlock(&sortlock);
+		if (n < SORTSPLIT) {
+			radixsort(sortv + off, sorttmp + off, sortc + off, n, d);
+			pthread_mutex_lock(&sortlock);
+		} else {
+			radixpass(sortv + off, sorttmp + off, sortc + off, n, d, cnt);
+			pthread_mutex_lock(&sortlock);
+			for (i = off + cnt[0], b = 1; b < 257; i += cnt[b++]) {
+				if (cnt[b] < 2)
+					continue;
+				if (nsortq == sortqsize) {
+					sortqsize = sortqsize ? sortqsize * 2 : 256;
+					if (!(sortq = realloc(sortq, sortqsize * sizeof *sortq)))
+						die("cannot realloc %zu bytes:", sortqsize * sizeof *sortq);
+				}
+				sortq[nsortq][0] = i;
+				sortq[nsortq][1] = cnt[b];
+				sortq[nsortq++][2] = d + 1;
 			}
-			tmpsel = tmpsel->right;
-			if (tmpsel == next)
-				offscreen = 1;
 		}
-		sel = tmpsel;
-		if (offscreen) {
-			curr = next;
-			calcoffsets();
+		sortbusy--;
+		pthread_cond_broadcast(&sortcond);
+	}
+	pthread_mutex_unlock(&sortlock);
+	return NULL;
+}
+
+/* write s as a -sort natural key into dst, or only measure it if dst is
+ * NULL; a run of digits becomes '0', its number of significant digits + 1
+ * and those digits, so that numbers compare by value */
+static size_t
+natkey(const char *s, unsigned char *dst)
+{
+	size_t n = 0, len;
+	const char *e;
+
+	while (*s) {
+		if (!isdigit((unsigned char)*s)) {
+			if (dst)
+				dst[n] = *s;
+			n++;
+			s++;
+			continue;
+		}
+		while (*s == '0' && isdigit((unsigned char)s[1]))
+			s++;
+		for (e = s; isdigit((unsigned char)*e); e++)
+			;
+		len = e - s - (*s == '0');
+		if (dst) {
+			dst[n] = '0';
+			dst[n + 1] = MIN(len, 254) + 1;
+			memcpy(dst + n + 2, e - len, len);
+		}
+		n += 2 + len;
+		s = e;
+	}
+	return n;
+}
+
+/* reorder the items by sortmode, keeping the input order of equal ones;
+ * matches are listed in item order, so this orders every match tier too */
+static void
+sortitems(void)
+{
+	pthread_t th[SORTTHREADS - 1];
+	unsigned char *buf = NULL, *p;
+	struct item *sorted;
+	uint64_t *sig;
+	size_t i, len, size = 0;
+	long nth;
+	int t;
+
+	if (nitems < 2)
+		return;
+	sortp = ecalloc(nitems, sizeof *sortp);
+	sortl = ecalloc(nitems, sizeof *sortl);
+	sortv = ecalloc(nitems, sizeof *sortv);
+	sorttmp = ecalloc(nitems, sizeof *sorttmp);
+	sortc = ecalloc(nitems, sizeof *sortc);
+	if (sortmode == SortLength)
+		size = nitems * 4;
+	else if (sortmode == SortNatural)
+		for (i = 0; i < nitems; i++)
+			size += natkey(searchkey(&items[i]), NULL);
+	buf = ecalloc(size + 1, 1);
+	for (p = buf, i = 0; i < nitems; i++) {
+		sortv[i] = i;
+		switch (sortmode) {
+		case SortAlpha:
+			sortp[i] = (const unsigned char *)searchkey(&items[i]);
+			sortl[i] = keylen[i];
+			break;
+		case SortLength:
+			len = strlen(itemtext(&items[i]));
+			p[0] = len >> 24;
+			p[1] = len >> 16;
+			p[2] = len >> 8;
+			p[3] = len;
+			sortp[i] = p;
+			sortl[i] = 4;
+			p += 4;
+			break;
+		case SortNatural:
+			sortp[i] = p;
+			sortl[i] = natkey(searchkey(&items[i]), p);
+			p += sortl[i];
+			break;
 		}
-		break;
-	case XK_Tab:
-		if (!sel)
-			return;
-		strncpy(text, sel->text, sizeof text - 1);
-		text[sizeof text - 1] = '\0';
-		cursor = strlen(text);
-		match();
-		break;
 	}
 
-draw:
-	drawmenu();
+	if (nitems < SORTSPLIT) {
+		radixsort(sortv, sorttmp, sortc, nitems, 0);
+	} else {
+		sortq = ecalloc(sortqsize = 256, sizeof *sortq);
+		sortq[0][0] = sortq[0][2] = 0;
+		sortq[0][1] = nitems;
+		nsortq = 1;
+		nth = sysconf(_SC_NPROCESSORS_ONLN);
+		nth = MAX(1, MIN(nth, SORTTHREADS));
+		for (t = 0; t < nth - 1; t++)
+			if (pthread_create(&th[t], NULL, sortworker, NULL))
+				break;
+		sortworker(NULL);
+		while (t--)
+			pthread_join(th[t], NULL);
+		free(sortq);
+		sortq = NULL;
+	}
+
+	/* apply the permutation; tiers are all -1 yet */
+	sorted = ecalloc(itemsize, sizeof *sorted);
+	for (i = 0; i < nitems; i++) {
+		sorted[i] = items[sortv[i]];
+		sorttmp[i] = keyoff[sortv[i]];
+	}
+	memcpy(keyoff, sorttmp, nitems * sizeof *keyoff);
+	for (i = 0; i < nitems; i++)
+		sorttmp[i] = keylen[sortv[i]];
+	memcpy(keylen, sorttmp, nitems * sizeof *keylen);
+	sig = ecalloc(itemsize, sizeof *sig);
+	for (i = 0; i < nitems; i++)
+		sig[i] = keysig[sortv[i]];
+	free(items);
+	free(keysig);
+	items = sorted;
+	keysig = sig;
+	for (i = 0; i < nitems; i++)
+		sorttmp[sortv[i]] = i;
+	hmove(&ids, sorttmp);
+	hmove(&uniq, sorttmp);
+	free(sortp);
+	free(sortl);
+	free(sortv);
+	free(sorttmp);
+	free(sortc);
+	free(buf);
 }
 
 static void
-buttonpress(XEvent *e)
+readstdin(void)
 {
+	char buf[sizeof text], *p, *s;
 	struct item *item;
-	XButtonPressedEvent *ev = &e->xbutton;
-	int x = 0, y = -icon_size, h = bh, w, item_num = 0;
 
-	if (ev->window != win)
+	if (passwd) {
+		inputw = lines = 0;
 		return;
+	}
 
-	/* right-click: exit */
-	if (ev->button == Button3)
-		exit(1);
+	if (informat != InLines) {
+		readrecords();
+	} else {
+		/* read each line from stdin and add it to the item list */
+		while (fgets(buf, sizeof buf, stdin)) {
+			if ((p = strchr(buf, '\n')))
+				*p = '\0';
+			item = newitem();
+			parseline(item, buf, &s);
+			setkey(item, s);
+			uniqitem(item);
+		}
+	}
+	if (sortmode)
+		sortitems();
+	lines = MIN(lines, nitems);
+	if (trigrams)
+		triindex();
+}
 
-	if (prompt && *prompt)
-		x += promptw;
+static int
+onscreen(struct item *item)
+{
+	size_t i, end = visibleend();
 
-	/* input field */
-	w = (lines > 0 || !matches) ? mw - x : inputw;
+	for (i = curr; i < end; i++)
+		if (matchat(i) == item)
+			return 1;
+	return 0;
+}
 
-	/* left-click on input: clear input,
-	 * NOTE: if there is no left-arrow the space for < is reserved so
-	 *		 add that to the input width */
-	if (ev->button == Button1 &&
-		((lines <= 0 && ev->x >= 0 && ev->x <= x + w +
-		  ((!prev || !curr->left) ? TEXTW("<") : 0)) ||
-		 (lines > 0 && ev->y >= y && ev->y <= y + h))) {
-		insert(NULL, -cursor);
-		drawmenu();
-		return;
-	}
-	/* middle-mouse click: paste selection */
-	if (ev->button == Button2) {
-		XConvertSelection(dpy, (ev->state & ShiftMask) ? clip : XA_PRIMARY,
-						  utf8, utf8, win, CurrentTime);
-		drawmenu();
-		return;
+/* whether adding or removing a match at position i moves what is shown;
+ * the list keeps its first item in place, the grid keeps its pixels */
+static int
+shiftsview(size_t i)
+{
+	return i < visibleend() && (lines > 0 || i >= curr);
+}
+
+/* delete item; returns 1 if the visible page changed */
+static int
+dropitem(struct item *item)
+{
+	int vis = onscreen(item);
+
+	vis = shiftsview(unlinkmatch(item)) || vis;
+	if (itemid(item))
+		hdel(&ids, item - items);
+	if (dedup)
+		hdel(&uniq, item - items);
+	freeitem(item);
+	/* keep a tombstone so item indices stay stable */
+	memset(item, 0, sizeof *item);
+	tiers[item - items] = REMOVED;
+	keysgarbage += keylen[item - items] + 1;
+	compactkeys();
+	nremoved++;
+	calcoffsets();
+	return vis;
+}
+
+/* apply one streamed line: add a new item, or replace or delete the item
+ * with the same --id=, setting *edited if not NULL; returns 1 if the
+ * visible page changed */
+static int
+streamline(char *line, int *edited)
+{
+	struct item tmp = { .src = cursrc }, *item;
+	char *s;
+	int del, vis = 0, tier, wassel, moved = 0;
+	unsigned int w;
+
+	del = parseline(&tmp, line, &s);
+	if (!(item = hget(&ids, itemid(&tmp)))) {
+		if (del || (dedup && hget(&uniq, itemid(&tmp) ? itemid(&tmp) : s))) {
+			freeitem(&tmp);
+			return 0;
+		}
+		item = newitem();
+		*item = tmp;
+		setkey(item, s);
+		if (itemid(item))
+			hput(&ids, item - items);
+		if (dedup)
+			hput(&uniq, item - items);
+	} else if (del) {
+		freeitem(&tmp);
+		if (edited)
+			*edited = 1;
+		return dropitem(item);
+	} else {
+		/* the id is unchanged, so its index slot stays valid */
+		if (edited)
+			*edited = 1;
+		vis = onscreen(item);
+		moved = srcorder && item->src != tmp.src;
+		freeitem(item);
+		*item = tmp;
+		keysgarbage += keylen[item - items] + 1;
+		setkey(item, s);
+		compactkeys();
 	}
-	/* scroll up */
-	if (ev->button == Button4 && prev) {
-		sel = curr = prev;
-		calcoffsets();
-		drawmenu();
-		return;
+	if ((w = textw_clamp(itemtext(item), mw / 3)) > inputw)
+		inputw = w;
+	/* only move the item when it enters, leaves or changes tier, or
+	 * changes source when ranked by it */
+	if ((tier = matchitem(item)) != tiers[item - items] || moved) {
+		wassel = selected() == item;
+		vis = shiftsview(unlinkmatch(item)) || vis;
+		vis = shiftsview(linkmatch(item, tier)) || vis;
+		if (wassel && tier >= 0)
+			sel = tierend[tier] - 1;
 	}
-	/* scroll down */
-	if (ev->button == Button5 && next) {
-		sel = curr = next;
-		calcoffsets();
-		drawmenu();
-		return;
+	calcoffsets();
+	return vis || onscreen(item);
+}
+
+/* apply the complete lines at the start of buf and keep the rest there;
+ * returns 1 if the visible page changed */
+static int
+streamlines(char *buf, size_t *len)
+{
+	char *p, *line;
+	int dirty = 0;
+
+	for (line = buf; (p = memchr(line, '\n', buf + *len - line)); line = p + 1) {
+		*p = '\0';
+		dirty |= streamline(line, NULL);
 	}
-	if (ev->button != Button1)
-		return;
-	if (ev->state & ~ControlMask)
-		return;
-	if (lines > 0) {
-		/* vertical list: (ctrl)left-click on item */
-		w = (mw - promptw) / columns;
-		for (item = curr; item != next; item = item->right) {
-			x = promptw + ((item_num % columns) * w);
-			y = (((item_num / columns) + 1) *  h) - icon_size;
-			if (ev->y >= y && ev->y <= (y + h) &&
-				ev->x >= x && ev->x <= (x + w)) {
-				puts((sel->value == NULL ? sel->text : sel->value));
-				if (!(ev->state & ControlMask))
-					exit(0);
-				sel = item;
-				if (sel) {
-					sel->out = 1;
-					drawmenu();
-				}
-				return;
-			}
-			++item_num;
-		}
-	} else if (matches) {
-		/* left-click on left arrow */
-		x += inputw;
-		w = TEXTW("<");
-		if (prev && curr->left) {
-			if (ev->x >= x && ev->x <= x + w) {
-				sel = curr = prev;
-				calcoffsets();
-				drawmenu();
-				return;
-			}
-		}
-		/* horizontal list: (ctrl)left-click on item */
-		for (item = curr; item != next; item = item->right) {
-			x += w;
-			w = MIN(TEXTW(item->text), mw - x - TEXTW(">"));
-			if (ev->x >= x && ev->x <= x + w) {
-				puts((sel->value == NULL ? sel->text : sel->value));
-				if (!(ev->state & ControlMask))
-					exit(0);
-				sel = item;
-				if (sel) {
-					sel->out = 1;
-					drawmenu();
-				}
-				return;
-			}
-		}
-		/* left-click on right arrow */
-		w = TEXTW(">");
-		x = mw - w;
-		if (next && ev->x >= x && ev->x <= x + w) {
-			sel = curr = next;
-			calcoffsets();
-			drawmenu();
-			return;
+	*len -= line - buf;
+	memmove(buf, line, *len);
+	return dirty;
+}
+
+/* read whatever is available on the stream; returns 0 at end of input */
+static int
+readstream(void)
+{
+	ssize_t n;
+
+	if (streamlen + BUFSIZ > streamsize &&
+	    !(streambuf = realloc(streambuf, (streamsize += BUFSIZ))))
+		die("cannot realloc %zu bytes:", streamsize);
+	if ((n = read(streamfd, streambuf + streamlen, streamsize - streamlen - 1)) < 0)
+		return errno == EINTR || errno == EAGAIN;
+	if (genpid > 0 && n > 0) {
+		if (genoutlen + n > genoutsize) {
+			genoutsize = MAX(genoutsize * 2, genoutlen + n);
+			if (!(genout = realloc(genout, genoutsize)))
+				die("cannot realloc %zu bytes:", genoutsize);
 		}
+		memcpy(genout + genoutlen, streambuf + streamlen, n);
+		genoutlen += n;
 	}
+	if (n == 0 && streamlen)
+		streambuf[streamlen++] = '\n'; /* flush an unterminated last line */
+	streamlen += n;
+	cursrc = 0;
+	if (streamlines(streambuf, &streamlen))
+		drawmenu();
+	return n > 0;
+}
+
+/* read whatever source s has printed; returns 0 at end of its output */
+static int
+readsource(struct source *s)
+{
+	ssize_t n;
+
+	if (s->len + BUFSIZ > s->size &&
+	    !(s->buf = realloc(s->buf, (s->size += BUFSIZ))))
+		die("cannot realloc %zu bytes:", s->size);
+	if ((n = read(s->fd, s->buf + s->len, s->size - s->len - 1)) < 0)
+		return errno == EINTR || errno == EAGAIN;
+	if (n == 0 && s->len)
+		s->buf[s->len++] = '\n';
+	s->len += n;
+	cursrc = s - srcs + 1;
+	if (streamlines(s->buf, &s->len))
+		drawmenu();
+	return n > 0;
 }
 
+/* run every -src command, their output goes into the items as it comes */
 static void
-mousemove(XEvent *e)
+srcstart(void)
 {
-	struct item *item;
-	XPointerMovedEvent *ev = &e->xmotion;
-	int x = 0, y = 0, h = bh, w, item_num = 0;
+	int i, fd[2], null;
 
-	if (lines > 0) {
-		w = (mw - promptw) / columns;
-		for (item = curr; item != next; item = item->right) { // TODO: too slow
-			x = promptw + ((item_num % columns) * w);
-			y = (((item_num / columns) + 1) *  h) - icon_size;
-			if (ev->y >= y && ev->y <= (y + h) &&
-				ev->x >= x && ev->x <= (x + w)) {
-				sel = item;
-				calcoffsets();
-				drawmenu();
-				return;
-			}
-			++item_num;
-		}
-	} else if (matches) {
-		x += inputw + promptw;
-		w = TEXTW("<");
-		for (item = curr; item != next; item = item->right) {
-			x += w;
-			w = MIN(TEXTW(item->text), mw - x - TEXTW(">"));
-			if (ev->x >= x && ev->x <= x + w) {
-				sel = item;
-				calcoffsets();
-				drawmenu();
-				return;
+	for (i = 0; i < nsrcs; i++) {
+		if (pipe(fd) < 0)
+			die("pipe:");
+		if ((srcs[i].pid = fork()) < 0)
+			die("fork:");
+		if (srcs[i].pid == 0) {
+			setpgid(0, 0);
+			close(fd[0]);
+			dup2(fd[1], STDOUT_FILENO);
+			close(fd[1]);
+			/* stdin may be the -S stream, which is not theirs to read */
+			if ((null = open("/dev/null", O_RDONLY)) >= 0) {
+				dup2(null, STDIN_FILENO);
+				close(null);
 			}
+			execl("/bin/sh", "sh", "-c", srcs[i].cmd, (char *)NULL);
+			_exit(127);
 		}
+		setpgid(srcs[i].pid, srcs[i].pid);
+		close(fd[1]);
+		fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+		srcs[i].fd = fd[0];
+		nsrcopen++;
 	}
 }
 
+/* source s is done; the items are final once all are */
 static void
-paste(void)
+srcdone(struct source *s)
 {
-	char *p, *q;
-	int di;
-	unsigned long dl;
-	Atom da;
+	close(s->fd);
+	s->fd = -1;
+	if (!waitpid(s->pid, NULL, WNOHANG))
+		letgo(s->pid, 0); /* still running with its output closed */
+	s->pid = 0;
+	free(s->buf);
+	s->buf = NULL;
+	s->len = s->size = 0;
+	nsrcopen--;
+}
 
-	/* we have been given the current selection, now insert it into input */
-	if (XGetWindowProperty(dpy, win, utf8, 0, (sizeof text / 4) + 1, False,
-						   utf8, &da, &di, &dl, &dl, (unsigned char **)&p)
-		== Success && p) {
-		insert(p, (q = strchr(p, '\n')) ? q - p : (ssize_t)strlen(p));
-		XFree(p);
-	}
-	drawmenu();
+static void *
+readstdin_thread(void *arg)
+{
+	readstdin();
+	return NULL;
 }
 
 static void
-parseline(struct item *item, char *line)
+clearitems(void)
 {
-	char *text, *val, *dupped;
-	int found_opts = 1;
+	size_t i;
 
-	const char *options[] = {"--icon=", "--value=", "--id="};
+	for (i = 0; i < nitems; i++)
+		freeitem(&items[i]);
+	memset(items, 0, nitems * sizeof *items);
+	nitems = nremoved = nmatches = keyslen = keysgarbage = 0;
+	nexts = nextfree = 0;
+	mcacheclear();
+	memset(tierend, 0, sizeof tierend);
+	prev = curr = next = sel = 0;
+	if (ids.slot)
+		memset(ids.slot, 0, ids.size * sizeof *ids.slot);
+	if (uniq.slot)
+		memset(uniq.slot, 0, uniq.size * sizeof *uniq.slot);
+	ids.count = uniq.count = 0;
+}
 
-	text = line;
-	item->value = NULL;
-	item->icon.fname = NULL;
-	item->icon.img = NULL;
-	item->icon.loaded = 0;
-	item->out = 0;
+/* bring the items up to date with the -watch file. lines up to the first
+ * changed one stay as they are; the items made by the lines from there on
+ * are dropped and those lines parsed again, so appending only parses what
+ * was appended. watchline holds the item made by each line, or UINT32_MAX
+ * if it made none; WATCHCUT marks a line that replaced or deleted an item
+ * by id, which cannot be undone, so the file is read anew from the start.
+ * returns 1 if the visible page changed */
+static int
+watchload(void)
+{
+	struct stat st;
+	char *buf, *lines, *line, *p, *end;
+	size_t cut, n, i, len = 0;
+	ssize_t r;
+	int fd, vis = 0, edited;
 
-	// TODO: build a sane parse
-	while (strncmp(text, "--", 2) == 0) {
-		for (int i = 0; i < sizeof options / sizeof options[0]; ++i) {
-			if (strncmp(text, options[i], strlen(options[i])) == 0) {
-				val = strtok(found_opts ? text : NULL, " ") +
-					strlen(options[i]);
-				if (!(dupped = strdup(val)))
-					die("cannot strdup %zu bytes:", strlen(val) + 1);
+	/* a file replaced by rename may be missing for a moment */
+	if ((fd = open(watchpath, O_RDONLY)) < 0)
+		return 0;
+	if (fstat(fd, &st) < 0)
+		die("fstat %s:", watchpath);
+	buf = ecalloc(st.st_size + BUFSIZ, 1);
+	for (n = st.st_size + BUFSIZ; (r = read(fd, buf + len, n - len - 1)) != 0;) {
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			die("read %s:", watchpath);
+		if ((len += r) + 1 == n && !(buf = realloc(buf, (n *= 2))))
+			die("cannot realloc %zu bytes:", n);
+	}
+	close(fd);
+	if (len == watchlen && !memcmp(buf, watchbuf, len)) {
+		free(buf);
+		return 0;
+	}
 
-				switch (i) {
-				case 0: item->icon.fname = dupped; break;
-				case 1: item->value      = dupped; break;
-				case 2: item->id         = dupped; break;
-				}
+	for (cut = 0; cut < MIN(len, watchlen) && buf[cut] == watchbuf[cut]; cut++)
+		;
+	/* back to the start of the line the change is in */
+	while (cut > 0 && watchbuf[cut - 1] != '\n')
+		cut--;
+	for (n = 0, i = 0; i < cut; i++)
+		n += watchbuf[i] == '\n';
+	for (i = n; i < nwatchlines && watchline[i] != WATCHCUT; i++)
+		;
+	/* starting over also clears the tombstones of dropped items */
+	if (i < nwatchlines || nremoved + nwatchlines - n > MAX(nitems / 2, BUFSIZ)) {
+		clearitems();
+		cut = n = nwatchlines = 0;
+		vis = 1;
+	}
+	for (i = n; i < nwatchlines; i++)
+		if (watchline[i] != UINT32_MAX && watchline[i] != WATCHCUT)
+			vis |= dropitem(&items[watchline[i]]);
+	nwatchlines = n;
 
-				text += strlen(options[i]) + strlen(dupped) + 1;
-				found_opts = 0;
-				break;
-			}
+	/* parsing cuts the lines up, buf is kept whole to compare with */
+	lines = ecalloc(len - cut + 1, 1);
+	memcpy(lines, buf + cut, len - cut);
+	for (line = lines, end = lines + len - cut; line < end; line = p + 1) {
+		if (!(p = memchr(line, '\n', end - line)))
+			p = end;
+		*p = '\0';
+		if (nwatchlines == watchlinesize) {
+			watchlinesize = watchlinesize ? watchlinesize * 2 : BUFSIZ;
+			if (!(watchline = realloc(watchline, watchlinesize * sizeof *watchline)))
+				die("cannot realloc %zu bytes:", watchlinesize * sizeof *watchline);
 		}
+		n = nitems;
+		edited = 0;
+		vis |= streamline(line, &edited);
+		if (nitems > n)
+			watchline[nwatchlines++] = n;
+		else if (edited)
+			watchline[nwatchlines++] = WATCHCUT;
+		else
+			watchline[nwatchlines++] = UINT32_MAX;
 	}
+	free(lines);
+	free(watchbuf);
+	watchbuf = buf;
+	watchlen = len;
+	return vis;
+}
 
-	if (!(item->text = strdup(text)))
-		die("cannot strdup %zu bytes:", strlen(text) + 1);
+/* read the -watch file and watch its directory for it to change; a
+ * directory watch also sees the file replaced by rename */
+static void
+watchstart(void)
+{
+#ifdef __linux__
+	char dir[PATH_MAX], *p;
+
+	if (snprintf(dir, sizeof dir, "%s", watchpath) >= sizeof dir)
+		die("path too long: %s", watchpath);
+	if (!(p = strrchr(dir, '/')))
+		strcpy(dir, ".");
+	else
+		p[p == dir] = '\0';
+	if ((watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0 &&
+	    inotify_add_watch(watchfd, dir, IN_MODIFY | IN_CLOSE_WRITE |
+	                      IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM) < 0) {
+		close(watchfd);
+		watchfd = -1;
+	}
+#endif
+	watchload();
+}
+
+/* drain the inotify events; returns 1 if the -watch file may have changed */
+static int
+watchevents(void)
+{
+	int hit = 0;
+#ifdef __linux__
+	union { struct inotify_event ev; char buf[4096]; } u; /* aligned */
+	const char *name = strrchr(watchpath, '/') ? strrchr(watchpath, '/') + 1 : watchpath;
+	struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+
+	while ((n = read(watchfd, u.buf, sizeof u.buf)) > 0)
+		for (p = u.buf; p < u.buf + n; p += sizeof *ev + ev->len) {
+			ev = (struct inotify_event *)p;
+			hit |= (ev->mask & IN_Q_OVERFLOW) ||
+			       (ev->len && !strcmp(ev->name, name));
+		}
+#endif
+	return hit;
 }
 
+/* kill the running generator, it is stale */
 static void
-readstdin(void)
+genstop(void)
+{
+	if (genpid <= 0)
+		return;
+	letgo(genpid, 1);
+	genpid = 0;
+	close(streamfd);
+	streamfd = -1;
+	streamlen = genoutlen = 0;
+}
+
+/* the generator hit end-of-file; remember what it printed for its query */
+static void
+gendone(void)
 {
-	char buf[sizeof text], *p;
-	size_t i, size = 0;
+	struct genres *r = &gencache[GENCACHE - 1];
+	pid_t pid;
+	int status;
 
-	if (passwd) {
-		inputw = lines = 0;
+	/* its output is complete unless it was killed; one that lingers after
+	 * closing it is not waited for */
+	if (!(pid = waitpid(genpid, &status, WNOHANG))) {
+		letgo(genpid, 0);
+	} else if (pid == genpid && !WIFEXITED(status)) {
+		genpid = 0;
+		genoutlen = 0;
 		return;
 	}
+	genpid = 0;
+	free(r->query);
+	free(r->out);
+	memmove(&gencache[1], &gencache[0], (GENCACHE - 1) * sizeof *gencache);
+	if (!(gencache[0].query = strdup(genquery)))
+		die("cannot strdup %zu bytes:", strlen(genquery) + 1);
+	gencache[0].out = genout;
+	gencache[0].len = genoutlen;
+	genout = NULL;
+	genoutlen = genoutsize = 0;
+}
 
-	/* read each line from stdin and add it to the item list */
-	for (i = 0; fgets(buf, sizeof buf, stdin); i++) {
-		if (i + 1 >= size / sizeof *items)
-			if (!(items = realloc(items, (size += BUFSIZ))))
-				die("cannot realloc %zu bytes:", size);
-		if ((p = strchr(buf, '\n')))
+/* replace the items with the output of the generator for the input text,
+ * from the cache if it ran for this query recently */
+static void
+genstart(void)
+{
+	struct genres r;
+	char *cmd, *buf, *line, *p, *end;
+	const char *q;
+	size_t i;
+	int fd[2], null;
+
+	genstop();
+	clearitems();
+	strcpy(genquery, text);
+	genpending = 0;
+	genhave = 1;
+	for (i = 0; i < GENCACHE && gencache[i].query; i++)
+		if (!strcmp(gencache[i].query, text))
+			break;
+	if (i < GENCACHE && gencache[i].query) {
+		r = gencache[i];
+		memmove(&gencache[1], &gencache[0], i * sizeof *gencache);
+		gencache[0] = r;
+		buf = ecalloc(r.len + 1, 1);
+		memcpy(buf, r.out, r.len);
+		for (line = buf, end = buf + r.len; line < end; line = p + 1) {
+			if (!(p = memchr(line, '\n', end - line)))
+				p = end;
 			*p = '\0';
+			streamline(line, NULL);
+		}
+		free(buf);
+		match();
+		drawmenu();
+		return;
+	}
 
-		parseline(&items[i], buf);
+	/* the query reaches the shell as $1, so it needs no quoting */
+	cmd = ecalloc(strlen(gencmd) * 2 + 1, 1);
+	for (p = cmd, q = gencmd; *q;)
+		if (!strncmp(q, "{q}", 3)) {
+			p = stpcpy(p, "\"$1\"");
+			q += 3;
+		} else {
+			*p++ = *q++;
+		}
+	if (pipe(fd) < 0)
+		die("pipe:");
+	if ((genpid = fork()) < 0)
+		die("fork:");
+	if (genpid == 0) {
+		setpgid(0, 0);
+		close(fd[0]);
+		dup2(fd[1], STDOUT_FILENO);
+		close(fd[1]);
+		/* stdin is the input of dmenu, not the generator's to read */
+		if ((null = open("/dev/null", O_RDONLY)) >= 0) {
+			dup2(null, STDIN_FILENO);
+			close(null);
+		}
+		execl("/bin/sh", "sh", "-c", cmd, "sh", text, (char *)NULL);
+		_exit(127);
 	}
-	if (items)
-		items[i].text = NULL;
-	lines = MIN(lines, i);
+	setpgid(genpid, genpid);
+	free(cmd);
+	close(fd[1]);
+	fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+	streamfd = fd[0];
+	match();
+	drawmenu();
 }
 
 static void
 run(void)
 {
 	XEvent ev;
-	int i;
+	struct pollfd pfd[3 + SOURCES];
+	struct timespec now, frame = { 0 }, watched = { 0 };
+	int i, n, timeout, wait, idle;
 
-	while (!XNextEvent(dpy, &ev)) {
+	matchstart();
+	for (;;) {
+		wait = -1;
+		if (genpending) {
+			/* debounce: run the generator once typing pauses */
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			wait = (genhave ? GENDELAYMS : 0) -
+			       (now.tv_sec - genat.tv_sec) * 1000 -
+			       (now.tv_nsec - genat.tv_nsec) / 1000000;
+			if (wait <= 0) {
+				genstart();
+				wait = -1;
+			}
+		}
+		pfd[0].fd = ConnectionNumber(dpy);
+		pfd[0].events = POLLIN;
+		/* poll() skips the negative fds of finished streams */
+		pfd[1].fd = matcher ? mpipe[0] : streamfd;
+		pfd[1].events = POLLIN;
+		pfd[2].fd = watchfd;
+		pfd[2].events = POLLIN;
+		for (n = 3, i = 0; i < nsrcs; i++) {
+			pfd[n].fd = srcs[i].fd;
+			pfd[n++].events = POLLIN;
+		}
+		/* XPending() flushes our requests before we go to sleep */
+		timeout = XPending(dpy) ? 0 : scrolly != scrollto ? SCROLLMS : -1;
+		if ((idle = timeout < 0 && prefetching))
+			timeout = 0;
+		if (wait >= 0 && (timeout < 0 || wait < timeout))
+			timeout = wait;
+		if (watchpath && watchfd < 0) {
+			/* without inotify the file is checked every WATCHMS */
+			wait = MAX(0, WATCHMS - sincems(&watched));
+			if (timeout < 0 || wait < timeout)
+				timeout = wait;
+		}
+		/* wake up to collect children that linger */
+		if (nchildren && (timeout < 0 || timeout > KILLMS))
+			timeout = KILLMS;
+		if ((n = poll(pfd, n, timeout)) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("poll:");
+		}
+		reap();
+		if (pfd[1].revents && matcher) {
+			matchdone(0);
+			drawmenu();
+		} else if (pfd[1].revents && !readstream()) {
+			close(streamfd);
+			streamfd = -1;
+			if (genpid > 0)
+				gendone();
+			matchstart(); /* if stdin was the last input */
+		}
+		if (watchpath && watchfd < 0 && sincems(&watched) >= WATCHMS) {
+			clock_gettime(CLOCK_MONOTONIC, &watched);
+			if (watchload())
+				drawmenu();
+		} else if (watchpath && pfd[2].revents && watchevents() && watchload()) {
+			drawmenu();
+		}
+		for (i = 0; i < nsrcs; i++) {
+			if (!pfd[3 + i].revents || readsource(&srcs[i]))
+				continue;
+			srcdone(&srcs[i]);
+			matchstart(); /* if that was the last one */
+		}
+		if (scrolly != scrollto) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if ((now.tv_sec - frame.tv_sec) * 1000 +
+			    (now.tv_nsec - frame.tv_nsec) / 1000000 >= SCROLLMS) {
+				frame = now;
+				scrollstep();
+			}
+		}
+		if (!XPending(dpy)) {
+			/* icons past the view load while there is nothing to do */
+			if (idle)
+				prefetching = prefetch();
+			continue;
+		}
+		XNextEvent(dpy, &ev);
 		if (preselected) {
 			if (preselected < 0)
 				preselected = lines + preselected;
 			for (i = 0; i < preselected; i++) {
-				if (sel && sel->right && (sel = sel->right) == next) {
-					curr = next;
-					calcoffsets();
+				if (nmatches && sel + 1 < nmatches && ++sel == next) {
+					setcurr(next);
 				}
 			}
 			drawmenu();
@@ -1179,8 +4379,10 @@ setup(void)
 			mw = (dmw > 0 ? dmw : wa.width);
 		}
 	}
-	for (item = items; item && item->text; ++item) {
-		if ((tmp = textw_clamp(item->text, mw/3)) > inputw) {
+	for (item = items; item < items + nitems; ++item) {
+		if (tiers[item - items] == REMOVED)
+			continue;
+		if ((tmp = itemw(item, mw/3)) > inputw) {
 			if ((inputw = tmp) == mw/3)
 				break;
 		}
@@ -1252,10 +4454,15 @@ setup(void)
 static void
 usage(void)
 {
-	fputs("usage: dmenu [-bcCfiPv] [-l lines] [-p prompt] [-fn font] [-m monitor]\n"
+	fputs("usage: dmenu [-0bcCfiPrRSuv] [-l lines] [-p prompt] [-fn font] [-m monitor]\n"
 	      "             [-x xoffset] [-y yoffset] [-z width]\n"
 	      "             [-nb color] [-nf color] [-sb color] [-sf color]\n"
-	      "             [-icmd command] [-isize size] [-bidi]\n"
+	      "             [-icmd command] [-isize size] [-icache mb] [-itheme theme]\n"
+	      "             [-bidi] [-tri] [-trif file] [-gen command]\n"
+	      "             [-sort alpha|length|natural]\n"
+	      "             [-d delim] [-nth fields] [-with-nth fields]\n"
+	      "             [-src command ...] [-srcorder source|arrival] [-watch file]\n"
+	      "             [-snapshot file] [-save-snapshot file]\n"
 	      "             [-w windowid] [-n number] [-nm]\n", stderr);
 	exit(1);
 }
@@ -1264,7 +4471,8 @@ int
 main(int argc, char *argv[])
 {
 	XWindowAttributes wa;
-	int i, fast = 0;
+	pthread_t reader;
+	int i, fast = 0, threaded;
 
 	char *envfont = getenv("FONT_SIZE");
 	if (envfont == NULL || strcmp(envfont, "") == 0)
@@ -1282,14 +4490,25 @@ main(int argc, char *argv[])
 		} else if (!strcmp(argv[i], "-f")) { /* grabs keyboard before reading stdin */
 			fast = 1;
 		} else if (!strcmp(argv[i], "-i")) { /* case-insensitive item matching */
-			fstrncmp = strncasecmp;
-			fstrstr = cistrstr;
+			fold = 1;
 		} else if (!strcmp(argv[i], "-P")) { /* is the input a password */
 			passwd = 1;
 		} else if (!strcmp(argv[i], "-nm")) { /* do not display as managed wm window */
 			managed = 0;
 		} else if (!strcmp(argv[i], "-bidi")) {
 			bidi = 1;
+		} else if (!strcmp(argv[i], "-S")) { /* keep reading stdin while running */
+			streamfd = STDIN_FILENO;
+		} else if (!strcmp(argv[i], "-0")) { /* items are NUL-terminated */
+			informat = InNul;
+		} else if (!strcmp(argv[i], "-R")) { /* items are length-prefixed records */
+			informat = InRecord;
+		} else if (!strcmp(argv[i], "-r")) { /* match the input as a regex */
+			regexmode = 1;
+		} else if (!strcmp(argv[i], "-u")) { /* drop duplicate items */
+			dedup = 1;
+		} else if (!strcmp(argv[i], "-tri")) { /* index items by trigram */
+			trigrams = 1;
 		} else if (i + 1 == argc) {
 			usage();
 
@@ -1348,12 +4567,65 @@ main(int argc, char *argv[])
 			icon_command = argv[++i];
 		} else if (!strcmp(argv[i], "-isize")) { /* icon size */
 			icon_size = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-icache")) { /* icon memory */
+			icon_cache = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-itheme")) { /* icon theme */
+			icon_theme = argv[++i];
+		} else if (!strcmp(argv[i], "-gen")) { /* item generator run per query */
+			gencmd = argv[++i];
+		} else if (!strcmp(argv[i], "-src")) { /* item source run concurrently */
+			if (nsrcs == SOURCES)
+				die("at most %d -src commands", SOURCES);
+			srcs[nsrcs++].cmd = argv[++i];
+		} else if (!strcmp(argv[i], "-watch")) { /* items from a file, reloaded */
+			watchpath = argv[++i];
+		} else if (!strcmp(argv[i], "-srcorder")) { /* items ranked by source */
+			if (!strcmp(argv[++i], "source"))
+				srcorder = 1;
+			else if (!strcmp(argv[i], "arrival"))
+				srcorder = 0;
+			else
+				usage();
+		} else if (!strcmp(argv[i], "-trif")) { /* trigram index sidecar file */
+			trifile = argv[++i];
+			trigrams = 1;
+		} else if (!strcmp(argv[i], "-d")) { /* field delimiter */
+			delim = argv[++i];
+		} else if (!strcmp(argv[i], "-nth")) { /* fields matched */
+			nnth = parsefields(argv[++i], nth);
+		} else if (!strcmp(argv[i], "-with-nth")) { /* fields shown */
+			nwnth = parsefields(argv[++i], wnth);
+		} else if (!strcmp(argv[i], "-sort")) { /* item order */
+			if (!strcmp(argv[++i], "alpha"))
+				sortmode = SortAlpha;
+			else if (!strcmp(argv[i], "length"))
+				sortmode = SortLength;
+			else if (!strcmp(argv[i], "natural"))
+				sortmode = SortNatural;
+			else
+				usage();
+		} else if (!strcmp(argv[i], "-snapshot")) { /* items from a snapshot */
+			snapfile = argv[++i];
+		} else if (!strcmp(argv[i], "-save-snapshot")) { /* write a snapshot */
+			snapout = argv[++i];
 		} else {
 			usage();
 		}
 
+	if (passwd || informat != InLines || gencmd || snapfile || snapout) {
+		streamfd = -1;
+		nsrcs = 0;
+		watchpath = NULL;
+	}
+	if (snapfile || snapout)
+		gencmd = NULL;
+	srcstart();
 	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
 		fputs("warning: no locale support\n", stderr);
+	/* stdin is read and parsed while the display and fonts are set up;
+	 * nothing below touches items until the reader is joined */
+	threaded = streamfd < 0 && !gencmd && !nsrcs && !watchpath && !snapfile &&
+	           !pthread_create(&reader, NULL, readstdin_thread, NULL);
 	if (!(dpy = XOpenDisplay(NULL)))
 		die("cannot open display");
 	screen = DefaultScreen(dpy);
@@ -1373,13 +4645,24 @@ main(int argc, char *argv[])
 		die("pledge");
 #endif
 
-	if (fast && !isatty(0)) {
+	if (fast && !isatty(0))
 		grabkeyboard();
+	/* with -S, -gen or -src items arrive in run() instead */
+	if (threaded && (errno = pthread_join(reader, NULL)))
+		die("pthread_join:");
+	else if (snapfile)
+		snapload();
+	else if (watchpath)
+		watchstart();
+	else if (!threaded && streamfd < 0 && !gencmd && !nsrcs)
 		readstdin();
-	} else {
-		readstdin();
-		grabkeyboard();
+	if (snapout) {
+		snapsave();
+		cleanup();
+		return 0;
 	}
+	if (!fast || isatty(0))
+		grabkeyboard();
 	setup();
 	run();
 
@@ -1,7 +1,10 @@
 /* See LICENSE file for copyright and license details. */
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
 #include <Imlib2.h>
@@ -61,6 +64,83 @@ utf8decode(const char *c, long *u, size_t clen)
 	return len;
 }
 
+static void *
+resize(void *p, unsigned int n, size_t elem)
+{
+	if (!(p = realloc(p, n * elem)))
+		die("cannot realloc %zu bytes:", n * elem);
+	return p;
+}
+
+/* send the queued rectangles, then the glyphs drawn over them; runs of the
+ * same color go out in one request */
+static void
+batch_flush(Drw *drw)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < drw->nrects; i = j) {
+		for (j = i + 1; j < drw->nrects && drw->rectpixels[j] == drw->rectpixels[i]; j++)
+			;
+		XSetForeground(drw->dpy, drw->gc, drw->rectpixels[i]);
+		XFillRectangles(drw->dpy, drw->drawable, drw->gc, drw->rects + i, j - i);
+	}
+	for (i = 0; i < drw->nglyphs; i = j) {
+		for (j = i + 1; j < drw->nglyphs && drw->glyphcolors[j].pixel == drw->glyphcolors[i].pixel; j++)
+			;
+		XftDrawGlyphFontSpec(drw->xftdraw, &drw->glyphcolors[i], drw->glyphs + i, j - i);
+	}
+	drw->nrects = drw->ntextboxes = drw->nglyphs = 0;
+}
+
+static void
+batch_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned long pixel)
+{
+	XRectangle *b;
+	unsigned int i;
+
+	/* a rectangle over queued text has to wait until that text is drawn */
+	for (i = 0; i < drw->ntextboxes; i++) {
+		b = &drw->textboxes[i];
+		if (x < b->x + b->width && b->x < x + (int)w &&
+		    y < b->y + b->height && b->y < y + (int)h) {
+			batch_flush(drw);
+			break;
+		}
+	}
+	if (drw->nrects == drw->rectsize) {
+		drw->rectsize = drw->rectsize ? drw->rectsize * 2 : 64;
+		drw->rects = resize(drw->rects, drw->rectsize, sizeof *drw->rects);
+		drw->rectpixels = resize(drw->rectpixels, drw->rectsize, sizeof *drw->rectpixels);
+	}
+	drw->rects[drw->nrects] = (XRectangle){ x, y, w, h };
+	drw->rectpixels[drw->nrects++] = pixel;
+}
+
+static void
+batch_glyphs(Drw *drw, XftFont *xfont, XftColor *color, int x, int y, const char *text, int len)
+{
+	XGlyphInfo ext;
+	FT_UInt glyph;
+	long codepoint;
+	size_t n;
+
+	for (; len > 0; text += n, len -= n) {
+		if (!(n = utf8decode(text, &codepoint, len)))
+			break;
+		glyph = XftCharIndex(drw->dpy, xfont, codepoint);
+		if (drw->nglyphs == drw->glyphsize) {
+			drw->glyphsize = drw->glyphsize ? drw->glyphsize * 2 : 256;
+			drw->glyphs = resize(drw->glyphs, drw->glyphsize, sizeof *drw->glyphs);
+			drw->glyphcolors = resize(drw->glyphcolors, drw->glyphsize, sizeof *drw->glyphcolors);
+		}
+		drw->glyphs[drw->nglyphs] = (XftGlyphFontSpec){ xfont, glyph, x, y };
+		drw->glyphcolors[drw->nglyphs++] = *color;
+		XftGlyphExtents(drw->dpy, xfont, &glyph, 1, &ext);
+		x += ext.xOff;
+	}
+}
+
 Drw *
 drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h)
 {
@@ -72,6 +152,8 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->w = w;
 	drw->h = h;
 	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
+	drw->xftdraw = XftDrawCreate(dpy, drw->drawable, DefaultVisual(dpy, screen),
+	                             DefaultColormap(dpy, screen));
 	drw->gc = XCreateGC(dpy, root, 0, NULL);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
 
@@ -84,22 +166,144 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 	if (!drw)
 		return;
 
+	batch_flush(drw);
 	drw->w = w;
 	drw->h = h;
 	if (drw->drawable)
 		XFreePixmap(drw->dpy, drw->drawable);
 	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	XftDrawChange(drw->xftdraw, drw->drawable);
 }
 
 void
 drw_free(Drw *drw)
 {
+	XftDrawDestroy(drw->xftdraw);
+	free(drw->rects);
+	free(drw->rectpixels);
+	free(drw->textboxes);
+	free(drw->glyphs);
+	free(drw->glyphcolors);
 	XFreePixmap(drw->dpy, drw->drawable);
 	XFreeGC(drw->dpy, drw->gc);
 	drw_fontset_free(drw->fonts);
 	free(drw);
 }
 
+/* fonts resolved by fontconfig are cached by name in fontcache; the
+ * first line is a stamp of what matching depends on, and a different
+ * stamp drops the cache */
+static char fontcache[PATH_MAX];
+static char fontstamp[BUFSIZ];
+static int fontstampok;
+
+static void
+fontcache_init(Drw *drw)
+{
+	const char *paths[] = {
+		"/etc/fonts/fonts.conf", "/etc/fonts/conf.d", "/usr/share/fonts",
+		"/usr/local/share/fonts", "/var/cache/fontconfig",
+		"~/.config/fontconfig/fonts.conf", "~/.config/fontconfig/conf.d",
+		"~/.fonts", "~/.local/share/fonts", "~/.cache/fontconfig"
+	};
+	const char *res[] = { "dpi", "antialias", "hinting", "hintstyle", "rgba", "lcdfilter" };
+	const char *home = getenv("HOME"), *v;
+	char path[PATH_MAX];
+	size_t i, n;
+	struct stat st;
+
+	if (fontcache[0] || !home)
+		return;
+	if ((v = getenv("XDG_CACHE_HOME")) && *v)
+		n = snprintf(fontcache, sizeof fontcache, "%s/dmenu-fonts", v);
+	else
+		n = snprintf(fontcache, sizeof fontcache, "%s/.cache/dmenu-fonts", home);
+	if (n >= sizeof fontcache) {
+		fontcache[0] = '\0';
+		return;
+	}
+	/* config files, font directories and fontconfig's own caches, which
+	 * fc-cache rewrites when fonts are installed */
+	n = snprintf(fontstamp, sizeof fontstamp, "%s %dx%d %dx%d",
+	             (v = getenv("FONTCONFIG_FILE")) ? v : "-",
+	             DisplayWidth(drw->dpy, drw->screen),
+	             DisplayHeight(drw->dpy, drw->screen),
+	             DisplayWidthMM(drw->dpy, drw->screen),
+	             DisplayHeightMM(drw->dpy, drw->screen));
+	for (i = 0; i < sizeof paths / sizeof *paths && n < sizeof fontstamp; i++) {
+		if (paths[i][0] == '~')
+			snprintf(path, sizeof path, "%s%s", home, paths[i] + 1);
+		else
+			snprintf(path, sizeof path, "%s", paths[i]);
+		if (stat(path, &st))
+			st.st_mtime = st.st_size = 0;
+		n += snprintf(fontstamp + n, sizeof fontstamp - n, " %lld.%lld",
+		              (long long)st.st_mtime, (long long)st.st_size);
+	}
+	/* Xft resources that XftDefaultSubstitute() applies */
+	for (i = 0; i < sizeof res / sizeof *res && n < sizeof fontstamp; i++)
+		n += snprintf(fontstamp + n, sizeof fontstamp - n, " %s",
+		              (v = XGetDefault(drw->dpy, "Xft", res[i])) ? v : "-");
+	if (n >= sizeof fontstamp)
+		fontcache[0] = '\0';
+}
+
+/* open fontname from the pattern it resolved to before, if cached */
+static XftFont *
+fontcache_get(Drw *drw, const char *fontname)
+{
+	char *line = NULL, *p;
+	size_t len = strlen(fontname), size = 0;
+	FcPattern *pattern;
+	FcChar8 *file;
+	XftFont *xfont = NULL;
+	FILE *fp;
+
+	fontcache_init(drw);
+	if (!fontcache[0] || !(fp = fopen(fontcache, "r")))
+		return NULL;
+	/* patterns carry their charset, so lines can be long */
+	if (getline(&line, &size, fp) > 0 && (p = strchr(line, '\n'))) {
+		*p = '\0';
+		fontstampok = !strcmp(line, fontstamp);
+	}
+	while (fontstampok && !xfont && getline(&line, &size, fp) > 0) {
+		if (strncmp(line, fontname, len) || line[len] != '\t' ||
+		    !(p = strchr(line, '\n')))
+			continue;
+		*p = '\0';
+		if (!(pattern = FcNameParse((FcChar8 *)line + len + 1)))
+			continue;
+		/* a font may have gone from a directory the stamp misses */
+		if (FcPatternGetString(pattern, FC_FILE, 0, &file) != FcResultMatch ||
+		    access((char *)file, R_OK) ||
+		    !(xfont = XftFontOpenPattern(drw->dpy, pattern)))
+			FcPatternDestroy(pattern);
+	}
+	free(line);
+	fclose(fp);
+	return xfont;
+}
+
+static void
+fontcache_put(const char *fontname, XftFont *xfont)
+{
+	FcChar8 *s;
+	FILE *fp;
+
+	if (!fontcache[0] || strpbrk(fontname, "\t\n") ||
+	    !(s = FcNameUnparse(xfont->pattern)))
+		return;
+	if ((fp = fopen(fontcache, fontstampok ? "a" : "w"))) {
+		if (!fontstampok)
+			fprintf(fp, "%s\n", fontstamp);
+		fontstampok = 1;
+		fprintf(fp, "%s\t%s\n", fontname, (char *)s);
+		fclose(fp);
+	}
+	free(s);
+}
+
 /* This function is an implementation detail. Library users should use
  * drw_fontset_create instead.
  */
@@ -116,9 +320,12 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 		 * FcNameParse; using the latter results in the desired fallback
 		 * behaviour whereas the former just results in missing-character
 		 * rectangles being drawn, at least with some fonts. */
-		if (!(xfont = XftFontOpenName(drw->dpy, drw->screen, fontname))) {
-			fprintf(stderr, "error, cannot load font from name: '%s'\n", fontname);
-			return NULL;
+		if (!(xfont = fontcache_get(drw, fontname))) {
+			if (!(xfont = XftFontOpenName(drw->dpy, drw->screen, fontname))) {
+				fprintf(stderr, "error, cannot load font from name: '%s'\n", fontname);
+				return NULL;
+			}
+			fontcache_put(fontname, xfont);
 		}
 		if (!(pattern = FcNameParse((FcChar8 *) fontname))) {
 			fprintf(stderr, "error, cannot parse font name to pattern: '%s'\n", fontname);
@@ -242,19 +449,20 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 {
 	if (!drw || !drw->scheme)
 		return;
+	if (filled) {
+		batch_rect(drw, x, y, w, h, drw->scheme[invert ? ColBg : ColFg].pixel);
+		return;
+	}
+	batch_flush(drw);
 	XSetForeground(drw->dpy, drw->gc, invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel);
-	if (filled)
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-	else
-		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
+	XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
 }
 
 int
 drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, unsigned int toppad, const char *text, int invert)
 {
-	int i, ty, ellipsis_x = 0;
-	unsigned int tmpw, ew, ellipsis_w = 0, ellipsis_len, ellipsis_width;
-	XftDraw *d = NULL;
+	int i, ty, ellipsis_x = 0, bx = x, by = y;
+	unsigned int tmpw, ew, ellipsis_w = 0, ellipsis_len, ellipsis_width, bw = w, bh = h;
 	Fnt *usedfont, *curfont, *nextfont;
 	int utf8strlen, utf8charlen, render = x || y || w || h;
 	long utf8codepoint = 0;
@@ -274,11 +482,7 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	if (!render) {
 		w = invert ? invert : ~invert;
 	} else {
-		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable,
-		                  DefaultVisual(drw->dpy, drw->screen),
-		                  DefaultColormap(drw->dpy, drw->screen));
+		batch_rect(drw, x, y, w, h, drw->scheme[invert ? ColFg : ColBg].pixel);
 		x += lpad;
 		w -= lpad;
 	}
@@ -331,8 +535,8 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		if (utf8strlen) {
 			if (render) {
 				ty = (toppad / 2) + y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-				XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
-				                  usedfont->xfont, x, ty, (XftChar8 *)utf8str, utf8strlen);
+				batch_glyphs(drw, usedfont->xfont, &drw->scheme[invert ? ColBg : ColFg],
+				             x, ty, utf8str, utf8strlen);
 			}
 			x += ew;
 			w -= ew;
@@ -391,12 +595,45 @@ no_match:
 			}
 		}
 	}
-	if (d)
-		XftDrawDestroy(d);
+	if (render) {
+		if (drw->ntextboxes == drw->textboxsize) {
+			drw->textboxsize = drw->textboxsize ? drw->textboxsize * 2 : 64;
+			drw->textboxes = resize(drw->textboxes, drw->textboxsize, sizeof *drw->textboxes);
+		}
+		drw->textboxes[drw->ntextboxes++] = (XRectangle){ bx, by, bw, bh };
+	}
 
 	return x + (render ? w : 0);
 }
 
+void
+drw_copy(Drw *drw, int x, int y, unsigned int w, unsigned int h, int dx, int dy)
+{
+	if (!drw)
+		return;
+
+	batch_flush(drw);
+	XCopyArea(drw->dpy, drw->drawable, drw->drawable, drw->gc, x, y, w, h, dx, dy);
+}
+
+Pixmap
+drw_save(Drw *drw, int x, int y, unsigned int w, unsigned int h)
+{
+	Pixmap pm;
+
+	batch_flush(drw);
+	pm = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	XCopyArea(drw->dpy, drw->drawable, pm, drw->gc, x, y, w, h, 0, 0);
+	return pm;
+}
+
+void
+drw_restore(Drw *drw, Pixmap pm, int x, int y, unsigned int w, unsigned int h)
+{
+	batch_flush(drw);
+	XCopyArea(drw->dpy, pm, drw->drawable, drw->gc, 0, 0, w, h, x, y);
+}
+
 Imlib_Image
 load_icon_image(Drw *drw, const char *file, int iconh, Imlib_Load_Error *err)
 {
@@ -418,14 +655,17 @@ load_icon_image(Drw *drw, const char *file, int iconh, Imlib_Load_Error *err)
 
 	icon = imlib_create_cropped_scaled_image(0, 0, imgsize, imgsize,
 											 iconh, iconh);
+	/* only the scaled copy is kept; the original goes to imlib's cache */
+	imlib_free_image();
 
 	return icon;
 }
 
 void
-drw_icon(Drw *drw, Icn icon, int x, int y)
+drw_icon(Drw *drw, Imlib_Image img, int x, int y)
 {
-	imlib_context_set_image(icon.img);
+	batch_flush(drw);
+	imlib_context_set_image(img);
 	imlib_context_set_drawable(drw->drawable);
 	imlib_render_image_on_drawable(x, y);
 }
@@ -436,6 +676,7 @@ drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 	if (!drw)
 		return;
 
+	batch_flush(drw);
 	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
 	XSync(drw->dpy, False);
 }
@@ -21,17 +21,19 @@ typedef struct {
 	int screen;
 	Window root;
 	Drawable drawable;
+	XftDraw *xftdraw;
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+	/* rectangles and glyphs are queued and sent in batches */
+	XRectangle *rects, *textboxes;
+	unsigned long *rectpixels;
+	XftGlyphFontSpec *glyphs;
+	XftColor *glyphcolors;
+	unsigned int nrects, ntextboxes, nglyphs;
+	unsigned int rectsize, textboxsize, glyphsize;
 } Drw;
 
-typedef struct {
-	char *fname;
-	Imlib_Image img;
-	int loaded;
-} Icn;
-
 /* Drawable abstraction */
 Drw *drw_create(Display *dpy, int screen, Window win, unsigned int w, unsigned int h);
 void drw_resize(Drw *drw, unsigned int w, unsigned int h);
@@ -59,10 +61,13 @@ void drw_setscheme(Drw *drw, Clr *scm);
 /* Drawing functions */
 void drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert);
 int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, unsigned int toppad, const char *text, int invert);
+void drw_copy(Drw *drw, int x, int y, unsigned int w, unsigned int h, int dx, int dy);
+Pixmap drw_save(Drw *drw, int x, int y, unsigned int w, unsigned int h);
+void drw_restore(Drw *drw, Pixmap pm, int x, int y, unsigned int w, unsigned int h);
 
 /* Imlib functions */
 Imlib_Image load_icon_image(Drw *drw, const char *file, int iconh, Imlib_Load_Error *err);
-void drw_icon(Drw *drw, Icn icon, int x, int y);
+void drw_icon(Drw *drw, Imlib_Image img, int x, int y);
 
 /* Map functions */
 void drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h);